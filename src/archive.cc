@@ -0,0 +1,400 @@
+/*
+Copyright 2015 Johan Gunnarsson <johan.gunnarsson@gmail.com>
+
+This file is part of BTFS.
+
+BTFS is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+BTFS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+
+#include "archive.h"
+
+// Signatures of zip records
+#define ZIP_LOCAL_HEADER 0x04034b50
+#define ZIP_CENTRAL_HEADER 0x02014b50
+#define ZIP_END 0x06054b50
+#define ZIP64_END 0x06064b50
+#define ZIP64_END_LOCATOR 0x07064b50
+
+// Minimum sizes of zip records
+#define ZIP_LOCAL_HEADER_SIZE 30
+#define ZIP_CENTRAL_HEADER_SIZE 46
+#define ZIP_END_SIZE 22
+#define ZIP64_END_SIZE 56
+#define ZIP64_END_LOCATOR_SIZE 20
+
+#define TAR_BLOCK 512
+
+// Don't trust archives claiming huge indexes
+#define MAX_INDEX_SIZE (256 * 1024 * 1024)
+
+using namespace btfs;
+
+static uint64_t
+le(const char *p, int n) {
+	uint64_t v = 0;
+
+	for (int i = n - 1; i >= 0; i--)
+		v = (v << 8) | (uint8_t) p[i];
+
+	return v;
+}
+
+static bool
+has_suffix(const std::string& s, const char *suffix) {
+	size_t n = strlen(suffix);
+
+	return s.length() >= n &&
+		strcasecmp(s.c_str() + s.length() - n, suffix) == 0;
+}
+
+// Only plain relative paths, nothing escaping the archive directory
+static bool
+is_safe(const std::string& name) {
+	if (name.empty() || name[0] == '/' || name[name.length() - 1] == '/')
+		return false;
+
+	std::string::size_type start = 0;
+
+	while (start <= name.length()) {
+		std::string::size_type end = name.find('/', start);
+
+		if (end == std::string::npos)
+			end = name.length();
+
+		std::string c = name.substr(start, end - start);
+
+		if (c.empty() || c == "." || c == "..")
+			return false;
+
+		start = end + 1;
+	}
+
+	return true;
+}
+
+archive_type btfs::archive_type_of(const std::string& path) {
+	if (has_suffix(path, ".zip"))
+		return ARCHIVE_ZIP;
+	else if (has_suffix(path, ".tar"))
+		return ARCHIVE_TAR;
+	else
+		return ARCHIVE_NONE;
+}
+
+bool btfs::list_zip(const archive_reader& read, int64_t size,
+		std::vector<archive_entry>& entries) {
+	if (size < ZIP_END_SIZE)
+		return false;
+
+	// End of central directory record, possibly followed by a comment
+	int64_t tail = std::min(size, (int64_t) ZIP_END_SIZE + 0xffff);
+
+	std::vector<char> buf;
+
+	if (!read(size - tail, (size_t) tail, buf))
+		return false;
+
+	int64_t end = -1;
+
+	for (int64_t i = tail - ZIP_END_SIZE; i >= 0 && end < 0; i--) {
+		if (le(&buf[(size_t) i], 4) == ZIP_END)
+			end = i;
+	}
+
+	if (end < 0)
+		return false;
+
+	const char *e = &buf[(size_t) end];
+
+	uint64_t count = le(e + 10, 2);
+	uint64_t cd_size = le(e + 12, 4);
+	uint64_t cd_offset = le(e + 16, 4);
+
+	if (count == 0xffff || cd_size == 0xffffffff ||
+			cd_offset == 0xffffffff) {
+		// Zip64, the real values are in another record
+		if (end < ZIP64_END_LOCATOR_SIZE)
+			return false;
+
+		const char *l = e - ZIP64_END_LOCATOR_SIZE;
+
+		if (le(l, 4) != ZIP64_END_LOCATOR)
+			return false;
+
+		uint64_t e64_offset = le(l + 8, 8);
+
+		if (size < ZIP64_END_SIZE ||
+				e64_offset > (uint64_t) (size - ZIP64_END_SIZE))
+			return false;
+
+		std::vector<char> e64;
+
+		if (!read((int64_t) e64_offset, ZIP64_END_SIZE, e64) ||
+				le(&e64[0], 4) != ZIP64_END)
+			return false;
+
+		count = le(&e64[32], 8);
+		cd_size = le(&e64[40], 8);
+		cd_offset = le(&e64[48], 8);
+	}
+
+	// Written so that huge zip64 values can't wrap around
+	if (cd_size > MAX_INDEX_SIZE || cd_offset > (uint64_t) size ||
+			cd_size > (uint64_t) size - cd_offset)
+		return false;
+
+	std::vector<char> cd;
+
+	if (!read((int64_t) cd_offset, (size_t) cd_size, cd))
+		return false;
+
+	size_t p = 0;
+
+	for (uint64_t i = 0; i < count; i++) {
+		if (p + ZIP_CENTRAL_HEADER_SIZE > cd.size() ||
+				le(&cd[p], 4) != ZIP_CENTRAL_HEADER)
+			return false;
+
+		const char *h = &cd[p];
+
+		uint64_t method = le(h + 10, 2);
+		uint64_t compressed = le(h + 20, 4);
+		uint64_t uncompressed = le(h + 24, 4);
+		size_t name_len = (size_t) le(h + 28, 2);
+		size_t extra_len = (size_t) le(h + 30, 2);
+		size_t comment_len = (size_t) le(h + 32, 2);
+		uint64_t local = le(h + 42, 4);
+
+		size_t next = p + ZIP_CENTRAL_HEADER_SIZE + name_len +
+			extra_len + comment_len;
+
+		if (next > cd.size())
+			return false;
+
+		std::string name(h + ZIP_CENTRAL_HEADER_SIZE, name_len);
+
+		// Zip64 extended information, present for the saturated fields
+		const char *x = h + ZIP_CENTRAL_HEADER_SIZE + name_len;
+
+		for (size_t j = 0; j + 4 <= extra_len;) {
+			size_t id = (size_t) le(x + j, 2);
+			size_t n = (size_t) le(x + j + 2, 2);
+
+			if (j + 4 + n > extra_len)
+				break;
+
+			if (id == 0x0001) {
+				const char *v = x + j + 4;
+				const char *v_end = v + n;
+
+				if (uncompressed == 0xffffffff && v + 8 <= v_end) {
+					uncompressed = le(v, 8);
+					v += 8;
+				}
+
+				if (compressed == 0xffffffff && v + 8 <= v_end) {
+					compressed = le(v, 8);
+					v += 8;
+				}
+
+				if (local == 0xffffffff && v + 8 <= v_end)
+					local = le(v, 8);
+			}
+
+			j += 4 + n;
+		}
+
+		p = next;
+
+		// Compressed members can't be served as a byte range
+		if (method != 0 || compressed != uncompressed || !is_safe(name))
+			continue;
+
+		// Nor members said to be outside of the archive
+		if (local >= (uint64_t) size ||
+				uncompressed > (uint64_t) size - local)
+			continue;
+
+		archive_entry entry;
+
+		entry.name = name;
+		entry.offset = (int64_t) local;
+		entry.size = (int64_t) uncompressed;
+		entry.resolved = false;
+
+		entries.push_back(entry);
+	}
+
+	return true;
+}
+
+bool btfs::resolve_zip(const archive_reader& read, archive_entry& entry) {
+	if (entry.resolved)
+		return true;
+
+	std::vector<char> h;
+
+	if (!read(entry.offset, ZIP_LOCAL_HEADER_SIZE, h) ||
+			le(&h[0], 4) != ZIP_LOCAL_HEADER)
+		return false;
+
+	entry.offset += ZIP_LOCAL_HEADER_SIZE + (int64_t) le(&h[26], 2) +
+		(int64_t) le(&h[28], 2);
+	entry.resolved = true;
+
+	return true;
+}
+
+static int64_t
+tar_number(const char *p, size_t n) {
+	// Base-256 encoding, used for sizes of 8 GiB and more
+	if ((uint8_t) p[0] & 0x80) {
+		int64_t v = p[0] & 0x3f;
+
+		for (size_t i = 1; i < n; i++)
+			v = (v << 8) | (uint8_t) p[i];
+
+		return v;
+	}
+
+	int64_t v = 0;
+
+	for (size_t i = 0; i < n && p[i]; i++) {
+		if (p[i] >= '0' && p[i] <= '7')
+			v = v * 8 + (p[i] - '0');
+	}
+
+	return v;
+}
+
+static std::string
+tar_string(const char *p, size_t n) {
+	return std::string(p, strnlen(p, n));
+}
+
+// Get path and size from a pax extended header
+static void
+parse_pax(const std::vector<char>& data, std::string& path, int64_t& size) {
+	size_t p = 0;
+
+	// Records are "LENGTH KEY=VALUE\n"
+	while (p < data.size()) {
+		size_t len = 0;
+		size_t i = p;
+
+		for (; i < data.size() && data[i] >= '0' && data[i] <= '9' &&
+				len <= data.size(); i++)
+			len = len * 10 + (size_t) (data[i] - '0');
+
+		// Stop at the first record that is truncated or malformed
+		if (len == 0 || p + len > data.size() || i + 1 >= p + len ||
+				data[i] != ' ' || data[p + len - 1] != '\n')
+			return;
+
+		std::string record(&data[i + 1], p + len - i - 2);
+
+		std::string::size_type eq = record.find('=');
+
+		if (eq != std::string::npos) {
+			std::string key = record.substr(0, eq);
+
+			if (key == "path")
+				path = record.substr(eq + 1);
+			else if (key == "size")
+				size = strtoll(record.c_str() + eq + 1, NULL, 10);
+		}
+
+		p += len;
+	}
+}
+
+bool btfs::list_tar(const archive_reader& read, int64_t size,
+		std::vector<archive_entry>& entries) {
+	std::string long_name;
+	int64_t long_size = -1;
+
+	for (int64_t offset = 0; offset + TAR_BLOCK <= size;) {
+		std::vector<char> h;
+
+		if (!read(offset, TAR_BLOCK, h))
+			return false;
+
+		// End of archive
+		if (std::all_of(h.begin(), h.end(), [](char c) { return c == 0; }))
+			break;
+
+		std::string name = tar_string(&h[0], 100);
+		std::string prefix = tar_string(&h[345], 155);
+		int64_t data_size = tar_number(&h[124], 12);
+		char type = h[156];
+
+		if (data_size < 0)
+			return false;
+
+		int64_t data = offset + TAR_BLOCK;
+		int64_t next = data + (data_size + TAR_BLOCK - 1) / TAR_BLOCK *
+			TAR_BLOCK;
+
+		if (type == 'L' || type == 'x') {
+			// Extended header for the next member
+			if (data_size > MAX_INDEX_SIZE)
+				return false;
+
+			std::vector<char> ext;
+
+			if (!read(data, (size_t) data_size, ext))
+				return false;
+
+			if (type == 'L')
+				long_name = tar_string(ext.data(), ext.size());
+			else
+				parse_pax(ext, long_name, long_size);
+		} else {
+			if (!long_name.empty())
+				name = long_name;
+			else if (!prefix.empty() && memcmp(&h[257], "ustar", 5) == 0)
+				name = prefix + "/" + name;
+
+			if (long_size >= 0) {
+				data_size = long_size;
+				next = data + (data_size + TAR_BLOCK - 1) /
+					TAR_BLOCK * TAR_BLOCK;
+			}
+
+			if ((type == '0' || type == '\0') && is_safe(name) &&
+					data + data_size <= size) {
+				archive_entry entry;
+
+				entry.name = name;
+				entry.offset = data;
+				entry.size = data_size;
+				entry.resolved = true;
+
+				entries.push_back(entry);
+			}
+
+			long_name.clear();
+			long_size = -1;
+		}
+
+		offset = next;
+	}
+
+	return true;
+}
@@ -0,0 +1,67 @@
+/*
+Copyright 2015 Johan Gunnarsson <johan.gunnarsson@gmail.com>
+
+This file is part of BTFS.
+
+BTFS is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+BTFS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BTFS_ARCHIVE_H
+#define BTFS_ARCHIVE_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace btfs
+{
+
+// Reads length bytes at offset of the archive into buf
+typedef std::function<bool(int64_t offset, size_t length,
+	std::vector<char>& buf)> archive_reader;
+
+// A member of an archive that can be read as a plain byte range
+struct archive_entry {
+	std::string name;
+	// Offset of the data, or of the local header if data is unresolved
+	int64_t offset;
+	int64_t size;
+	bool resolved;
+};
+
+enum archive_type {
+	ARCHIVE_NONE,
+	ARCHIVE_ZIP,
+	ARCHIVE_TAR,
+};
+
+archive_type archive_type_of(const std::string& path);
+
+// List the members of a zip file from its central directory. Only
+// stored (uncompressed) members are listed.
+bool list_zip(const archive_reader& read, int64_t size,
+	std::vector<archive_entry>& entries);
+
+// Find where the data of a zip member starts, from its local header
+bool resolve_zip(const archive_reader& read, archive_entry& entry);
+
+// List the regular files of a tar file from its headers
+bool list_tar(const archive_reader& read, int64_t size,
+	std::vector<archive_entry>& entries);
+
+}
+
+#endif
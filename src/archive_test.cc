@@ -0,0 +1,209 @@
+/*
+Copyright 2015 Johan Gunnarsson <johan.gunnarsson@gmail.com>
+
+This file is part of BTFS.
+
+BTFS is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+BTFS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "archive.h"
+
+#define TAR_BLOCK 512
+
+using namespace btfs;
+
+static int failures = 0;
+
+static void
+check(bool ok, const std::string& what) {
+	if (!ok) {
+		printf("FAIL: %s\n", what.c_str());
+		failures++;
+	}
+}
+
+// Append a tar header and the data following it
+static void
+add_member(std::vector<char>& tar, const std::string& name, char type,
+		const std::string& data) {
+	std::vector<char> h(TAR_BLOCK, 0);
+
+	memcpy(&h[0], name.data(), std::min(name.size(), (size_t) 100));
+	snprintf(&h[124], 12, "%011o", (unsigned int) data.size());
+	h[156] = type;
+	memcpy(&h[257], "ustar", 5);
+
+	tar.insert(tar.end(), h.begin(), h.end());
+	tar.insert(tar.end(), data.begin(), data.end());
+	tar.resize((tar.size() + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK, 0);
+}
+
+// Name of the single member listed from a pax header and a file after it
+static std::string
+list_with_pax(const std::string& pax) {
+	std::vector<char> tar;
+
+	add_member(tar, "pax", 'x', pax);
+	add_member(tar, "plain.txt", '0', "hello");
+
+	tar.resize(tar.size() + 2 * TAR_BLOCK, 0);
+
+	archive_reader read = [&tar](int64_t offset, size_t length,
+			std::vector<char>& buf) {
+		if (offset < 0 || (size_t) offset + length > tar.size())
+			return false;
+
+		buf.assign(tar.begin() + offset, tar.begin() + offset +
+			(int64_t) length);
+
+		return true;
+	};
+
+	std::vector<archive_entry> entries;
+
+	if (!list_tar(read, (int64_t) tar.size(), entries))
+		return "<failed>";
+
+	if (entries.size() != 1)
+		return "<" + std::to_string(entries.size()) + " entries>";
+
+	return entries[0].name;
+}
+
+static void
+put(std::vector<char>& v, uint64_t value, int n) {
+	for (int i = 0; i < n; i++)
+		v.push_back((char) (value >> (8 * i)));
+}
+
+// Number of members listed from a zip64 archive with one stored member,
+// whose central directory entry claims the given local header offset and
+// size, -1 if the archive is rejected
+static int
+list_zip64(uint64_t local, uint64_t size, uint64_t cd_offset) {
+	const std::string name = "a.txt";
+	const std::string data = "hello";
+
+	std::vector<char> zip;
+
+	put(zip, 0x04034b50, 4);
+	zip.resize(30, 0);
+	zip.insert(zip.end(), name.begin(), name.end());
+	zip.insert(zip.end(), data.begin(), data.end());
+
+	uint64_t cd_start = zip.size();
+
+	if (cd_offset == (uint64_t) -1)
+		cd_offset = cd_start;
+
+	// Central directory entry, with sizes and offset in the zip64 extra
+	put(zip, 0x02014b50, 4);
+	zip.resize(zip.size() + 16, 0);
+	put(zip, 0xffffffff, 4);
+	put(zip, 0xffffffff, 4);
+	put(zip, name.size(), 2);
+	put(zip, 28, 2);
+	zip.resize(zip.size() + 10, 0);
+	put(zip, 0xffffffff, 4);
+	zip.insert(zip.end(), name.begin(), name.end());
+	put(zip, 0x0001, 2);
+	put(zip, 24, 2);
+	put(zip, size, 8);
+	put(zip, size, 8);
+	put(zip, local, 8);
+
+	uint64_t cd_size = zip.size() - cd_start;
+	uint64_t e64 = zip.size();
+
+	// Zip64 end record, its locator and the end record
+	put(zip, 0x06064b50, 4);
+	zip.resize(zip.size() + 28, 0);
+	put(zip, 1, 8);
+	put(zip, cd_size, 8);
+	put(zip, cd_offset, 8);
+	put(zip, 0x07064b50, 4);
+	put(zip, 0, 4);
+	put(zip, e64, 8);
+	put(zip, 1, 4);
+	put(zip, 0x06054b50, 4);
+	zip.resize(zip.size() + 6, 0);
+	put(zip, 0xffff, 2);
+	put(zip, 0xffffffff, 4);
+	put(zip, 0xffffffff, 4);
+	put(zip, 0, 2);
+
+	archive_reader read = [&zip](int64_t offset, size_t length,
+			std::vector<char>& buf) {
+		if (offset < 0 || (size_t) offset + length > zip.size())
+			return false;
+
+		buf.assign(zip.begin() + offset, zip.begin() + offset +
+			(int64_t) length);
+
+		return true;
+	};
+
+	std::vector<archive_entry> entries;
+
+	if (!list_zip(read, (int64_t) zip.size(), entries))
+		return -1;
+
+	return (int) entries.size();
+}
+
+int
+main() {
+	check(list_with_pax("17 path=good.txt\n") == "good.txt",
+		"well-formed pax path");
+
+	// Malformed records are ignored, not trusted
+	const char *bad[] = {
+		"",
+		"2\n",
+		"3 \n",
+		"0 path=x\n",
+		"30 path=truncated\n",
+		"17 path=good.txtX",
+		"17path=good.txt\n\n",
+		"99999999999999999999 path=x\n",
+	};
+
+	for (size_t i = 0; i < sizeof (bad) / sizeof (bad[0]); i++) {
+		check(list_with_pax(bad[i]) == "plain.txt",
+			"malformed pax record \"" + std::string(bad[i]) + "\"");
+	}
+
+	// Parsing stops at the first malformed record
+	check(list_with_pax("2\n17 path=good.txt\n") == "plain.txt",
+		"record after a malformed one");
+
+	check(list_zip64(0, 5, (uint64_t) -1) == 1, "well-formed zip64 member");
+
+	// Hostile zip64 values are rejected, not wrapped around
+	check(list_zip64(1ULL << 63, 5, (uint64_t) -1) == 0,
+		"zip64 member at a negative offset");
+	check(list_zip64(0, (uint64_t) -16, (uint64_t) -1) == 0,
+		"zip64 member past the end of the archive");
+	check(list_zip64(0, 5, (uint64_t) -16) == -1,
+		"zip64 central directory past the end of the archive");
+
+	return failures ? 1 : 0;
+}
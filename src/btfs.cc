@@ -24,15 +24,56 @@ along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
 #endif
 
 #include <cstdlib>
+#include <cinttypes>
+#include <climits>
+#include <algorithm>
+#include <sstream>
 #include <iostream>
 #include <fstream>
+#include <tuple>
 
 #include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <fnmatch.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#endif
+
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
 
 #include <fuse3/fuse.h>
 #include <fuse3/fuse_opt.h>
+#include <fuse3/fuse_lowlevel.h>
+
+#if defined(__linux__) && defined(FUSE_CAP_PASSTHROUGH)
+// FUSE passthrough (Linux 6.9), as in <linux/fuse.h>
+#ifndef FUSE_DEV_IOC_BACKING_OPEN
+struct fuse_backing_map {
+	int32_t fd;
+	uint32_t flags;
+	uint64_t padding;
+};
+
+#define FUSE_DEV_IOC_BACKING_OPEN _IOW(229, 1, struct fuse_backing_map)
+#define FUSE_DEV_IOC_BACKING_CLOSE _IOW(229, 2, uint32_t)
+#endif
+
+#define HAVE_PASSTHROUGH 1
+#endif
 
 // The below pragma lines will silence lots of compiler warnings in the
 // libtorrent headers file. Not btfs' fault.
@@ -46,6 +87,7 @@ along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
 #include <libtorrent/peer_request.hpp>
 #include <libtorrent/alert_types.hpp>
 #include <libtorrent/magnet_uri.hpp>
+#include <libtorrent/address.hpp>
 #include <libtorrent/version.hpp>
 #if LIBTORRENT_VERSION_NUM >= 10200
 #include <libtorrent/torrent_flags.hpp>
@@ -55,8 +97,24 @@ along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
 #include <curl/curl.h>
 
 #include "btfs.h"
+#include "diskio.h"
 
 #define RETV(s, v) { s; return v; };
+
+// Most pieces remembered per torrent (--heatmap)
+#define HEATMAP_PIECES 1024
+
+// Seconds between saves of the heatmap while mounted
+#define HEATMAP_INTERVAL 60
+
+// Largest xattr value the kernel passes on
+#ifndef XATTR_SIZE_MAX
+#define XATTR_SIZE_MAX 65536
+#endif
+
+// Pieces of store files handed to libtorrent and not yet hash checked
+#define STORE_PIECES 16
+
 #define STRINGIFY(s) #s
 
 using namespace btfs;
@@ -67,414 +125,2027 @@ libtorrent::torrent_handle handle;
 
 pthread_t alert_thread;
 
-std::list<Read*> reads;
-
-// First piece index of the current sliding window
-int cursor;
-
-std::map<std::string,int> files;
-std::map<std::string,std::set<std::string> > dirs;
+std::list<File*> opens;
 
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t signal_cond = PTHREAD_COND_INITIALIZER;
 
-// Time used as "last modified" time
-time_t time_of_mount;
-
-static struct btfs_params params;
+TorrentPieces torrent_pieces(&lock, &signal_cond);
 
-static bool
-move_to_next_unfinished(int& piece, int num_pieces) {
-	for (; piece < num_pieces; piece++) {
-		if (!handle.have_piece(piece))
-			return true;
-	}
+// Sliding windows of pieces to download first, for foreground readers
+// and for background (bulk) readers
+Window window(&torrent_pieces);
+Window background(&torrent_pieces, BACKGROUND_WINDOW_SIZE,
+	BACKGROUND_PRIORITY);
 
-	return false;
-}
+// Processes that have set their class through XATTR_CLASS, until they
+// exit
+std::map<pid_t,bool> background_pids;
 
-static void
-jump(int piece, int size) {
-	auto ti = handle.torrent_file();
+// Virtual directory <-> archive file index (--archives)
+std::map<std::string,int> archives;
 
-	int tail = piece;
+// Archive directories being listed, and those done
+std::set<std::string> indexing;
+std::set<std::string> indexed;
 
-	if (!move_to_next_unfinished(tail, ti->num_pieces()))
-		return;
+// Path <-> archive member mapping
+std::map<std::string,Member> members;
 
-	cursor = tail;
+// Finished pieces ahead of readers, kept in memory (--cache-size)
+std::map<int,std::vector<char>> cache;
 
-	for (int i = 0; i < 16; i++) {
-		handle.piece_priority(tail++, 7);
-	}
-}
+// Cached pieces, least recently used first
+std::list<int> cache_order;
 
-static void
-advance() {
-	jump(cursor, 0);
-}
+// Pieces being read into the cache
+std::set<int> caching;
 
-Read::Read(char *buf, int index, off_t offset, size_t size) {
-	auto ti = handle.torrent_file();
+int64_t cache_bytes = 0;
 
-#if LIBTORRENT_VERSION_NUM < 10100
-	int64_t file_size = ti->file_at(index).size;
-#else
-	int64_t file_size = ti->files().file_size(index);
-#endif
+// Reads of finished pieces straight from disk (--io-uring)
+DiskReader disk_reader;
 
-	while (size > 0 && offset < file_size) {
-		libtorrent::peer_request part = ti->map_file(index, offset,
-			(int) size);
+// Open downloaded files, by index, for disk_reader
+std::map<int,int> disk_fds;
 
-		part.length = std::min(
-			ti->piece_size(part.piece) - part.start,
-			part.length);
+// Unfinished pieces in the foreground window, read by the reciprocity
+// plugin on the libtorrent network thread
+std::set<int> urgent;
 
-		parts.push_back(Part(part, buf));
+pthread_mutex_t urgent_lock = PTHREAD_MUTEX_INITIALIZER;
 
-		size -= (size_t) part.length;
-		offset += part.length;
-		buf += part.length;
-	}
-}
+// Piece event tracer (--trace), NULL if disabled
+Trace *trace = NULL;
 
-void Read::fail(int piece) {
-	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
-		if (i->part.piece == piece && !i->filled)
-			failed = true;
-	}
-}
+// Log of reads, to be replayed by btfssim (--access-log)
+std::ofstream access_log;
 
-void Read::copy(int piece, char *buffer, int size) {
-	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
-		if (i->part.piece == piece && !i->filled)
-			i->filled = (memcpy(i->buf, buffer + i->part.start,
-				(size_t) i->part.length)) != NULL;
-	}
-}
 
-void Read::trigger() {
-	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
-		if (handle.have_piece(i->part.piece))
-			handle.read_piece(i->part.piece);
-	}
-}
+std::map<std::string,int> files;
+std::map<std::string,std::set<std::string> > dirs;
 
-bool Read::finished() {
-	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
-		if (!i->filled)
-			return false;
-	}
+// Time used as "last modified" time
+time_t time_of_mount;
 
-	return true;
-}
+// HTTP mirrors (BEP 19 web seeds) to fall back on when the swarm is slow
+std::vector<std::string> web_seeds;
 
-int Read::size() {
-	int s = 0;
+// Pieces fetched from a mirror and being hashed by libtorrent, or being
+// fetched
+std::set<int> mirror_pieces;
 
-	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
-		s += i->part.length;
-	}
+// Directories in which libtorrent puts the files of the torrent, one per
+// data directory. The first one is the save path of the torrent.
+std::vector<std::string> save_paths;
 
-	return s;
-}
+// Index into save_paths of the directory each file is placed in
+std::vector<size_t> placement;
 
-int Read::read() {
-	if (size() <= 0)
-		return 0;
+// Path of each file relative to the save path, as in the metadata
+std::vector<std::string> paths;
 
-	// Trigger reads of finished pieces
-	trigger();
+// Content-addressed file store shared by all mounts, empty if disabled
+std::string store_path;
 
-	// Move sliding window to first piece to serve this request
-	jump(parts.front().part.piece, size());
+// Adds the pieces of store files to a magnet link once its metadata is in
+pthread_t store_thread;
 
-	while (!finished() && !failed)
-		// Wait for any piece to downloaded
-		pthread_cond_wait(&signal_cond, &lock);
+bool store_importing = false;
 
-	if (failed)
-		return -EIO;
-	else
-		return size();
-}
+// Set on unmount, to stop store_thread
+bool store_stop = false;
 
-static void
-setup() {
-	printf("Got metadata. Now ready to start downloading.\n");
+// Pieces store_thread has handed to libtorrent, until their hash check
+std::set<int> store_pieces;
 
-	auto ti = handle.torrent_file();
+// Whether the kernel accepted FUSE passthrough
+bool passthrough = false;
 
-	if (params.browse_only)
-		handle.pause();
+static struct btfs_params params;
 
-	for (int i = 0; i < ti->num_files(); ++i) {
-		std::string parent("");
+// Web seeds given on the command line
+static std::vector<std::string> web_seed_args;
 
-#if LIBTORRENT_VERSION_NUM < 10100
-		char *p = strdup(ti->file_at(i).path.c_str());
-#else
-		char *p = strdup(ti->files().file_path(i).c_str());
-#endif
+// Arguments of --peer options, in order
+static std::vector<std::string> peer_args;
 
-		if (!p)
-			continue;
+// Globs selecting the files to mount (--include, --exclude)
+static std::vector<std::string> include_args;
+static std::vector<std::string> exclude_args;
 
-		for (char *x = strtok(p, "/"); x; x = strtok(NULL, "/")) {
-			if (strlen(x) <= 0)
-				continue;
+// Peers to connect to as soon as the torrent is added (--peer)
+std::vector<libtorrent::tcp::endpoint> static_peers;
 
-			if (parent.length() <= 0)
-				// Root dir <-> children mapping
-				dirs["/"].insert(x);
-			else
-				// Non-root dir <-> children mapping
-				dirs[parent].insert(x);
+// Last time static peers were reconnected, in cluster mode
+time_t reconnected = 0;
 
-			parent += "/";
-			parent += x;
-		}
+// Whether metadata has been loaded and the file tree set up
+bool loaded = false;
 
-		free(p);
+// When metadata was loaded
+uint64_t loaded_us = 0;
 
-		// Path <-> file index mapping
-#if LIBTORRENT_VERSION_NUM < 10100
-		files["/" + ti->file_at(i).path] = i;
-#else
-		files["/" + ti->files().file_path(i)] = i;
-#endif
-	}
-}
+// File with the pieces read by earlier mounts of this torrent, empty
+// unless --heatmap
+std::string heatmap_path;
 
-static void
-handle_read_piece_alert(libtorrent::read_piece_alert *a, Log *log) {
-	printf("%s: piece %d size %d\n", __func__, static_cast<int>(a->piece),
-		a->size);
+// Pieces read by earlier mounts, as loaded along with the metadata, with
+// the average time they were first read and the number of mounts that
+// read them
+std::map<int,std::pair<int64_t,int>> earlier_reads;
 
-	pthread_mutex_lock(&lock);
+// Pieces read by this mount, and when, in ms after metadata was loaded
+std::map<int,int64_t> first_reads;
 
-	if (a->ec) {
-		*log << a->message() << std::endl;
+// Number of first_reads in the heatmap last saved, and when it was
+size_t saved_reads = 0;
+time_t heatmap_saved = 0;
 
-		for (reads_iter i = reads.begin(); i != reads.end(); ++i) {
-			(*i)->fail(a->piece);
-		}
-	} else {
-		for (reads_iter i = reads.begin(); i != reads.end(); ++i) {
-			(*i)->copy(a->piece, a->buffer.get(), a->size);
-		}
-	}
+// Number of pieces finished since mounting, for BTFS_IOC_WAIT
+int64_t pieces_finished = 0;
 
-	pthread_mutex_unlock(&lock);
+// Data directories given on the command line
+static std::vector<std::string> data_directory_args;
 
-	// Wake up all threads waiting for download
-	pthread_cond_broadcast(&signal_cond);
-}
+static uint64_t
+now_us() {
+	struct timespec ts;
 
-static void
-handle_piece_finished_alert(libtorrent::piece_finished_alert *a, Log *log) {
-	printf("%s: %d\n", __func__, static_cast<int>(a->piece_index));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	pthread_mutex_lock(&lock);
+	return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
 
-	for (reads_iter i = reads.begin(); i != reads.end(); ++i) {
-		(*i)->trigger();
+Trace::Trace(std::string p) : file(fopen(p.c_str(), "wb")) {
+	if (!file) {
+		perror("Failed to open trace");
+		return;
 	}
 
-	// Advance sliding window
-	advance();
+	setvbuf(file, NULL, _IOFBF, 1 << 20);
 
-	pthread_mutex_unlock(&lock);
+	fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), file);
 }
 
-static void
-handle_torrent_added_alert(libtorrent::torrent_added_alert *a, Log *log) {
-	pthread_mutex_lock(&lock);
-
-	handle = a->handle;
+Trace::~Trace() {
+	if (file)
+		fclose(file);
+}
 
-	if (a->handle.status().has_metadata)
-		setup();
+void Trace::event(trace_type type, int piece, int64_t value) {
+	trace_event e;
+	memset(&e, 0, sizeof (e));
 
-	pthread_mutex_unlock(&lock);
-}
+	e.piece = piece;
+	e.type = type;
+	e.value = value;
 
-static void
-handle_metadata_received_alert(libtorrent::metadata_received_alert *a,
-		Log *log) {
 	pthread_mutex_lock(&lock);
 
-	handle = a->handle;
+	// Under the lock, so that the file is in time order
+	e.time = now_us();
 
-	setup();
+	if (file)
+		fwrite(&e, sizeof (e), 1, file);
 
 	pthread_mutex_unlock(&lock);
 }
 
-static void
-handle_alert(libtorrent::alert *a, Log *log) {
-	switch (a->type()) {
-	case libtorrent::read_piece_alert::alert_type:
-		handle_read_piece_alert(
-			(libtorrent::read_piece_alert *) a, log);
-		break;
-	case libtorrent::piece_finished_alert::alert_type:
-		*log << a->message() << std::endl;
-		handle_piece_finished_alert(
-			(libtorrent::piece_finished_alert *) a, log);
-		break;
-	case libtorrent::metadata_received_alert::alert_type:
-		*log << a->message() << std::endl;
-		handle_metadata_received_alert(
-			(libtorrent::metadata_received_alert *) a, log);
-		break;
-	case libtorrent::torrent_added_alert::alert_type:
-		*log << a->message() << std::endl;
-		handle_torrent_added_alert(
-			(libtorrent::torrent_added_alert *) a, log);
-		break;
-	case libtorrent::dht_bootstrap_alert::alert_type:
-		*log << a->message() << std::endl;
-		// Force DHT announce because libtorrent won't by itself
-		handle.force_dht_announce();
-		break;
-	case libtorrent::dht_announce_alert::alert_type:
-	case libtorrent::dht_reply_alert::alert_type:
-	case libtorrent::metadata_failed_alert::alert_type:
-	case libtorrent::tracker_announce_alert::alert_type:
-	case libtorrent::tracker_reply_alert::alert_type:
-	case libtorrent::tracker_warning_alert::alert_type:
-	case libtorrent::tracker_error_alert::alert_type:
-	case libtorrent::lsd_peer_alert::alert_type:
-		*log << a->message() << std::endl;
-		break;
-	case libtorrent::stats_alert::alert_type:
-		//*log << a->message() << std::endl;
-		break;
-	default:
-		break;
-	}
+void Trace::block(int piece) {
+	pthread_mutex_lock(&lock);
 
-#if LIBTORRENT_VERSION_NUM < 10100
-	delete a;
-#endif
-}
+	bool first = started.insert(piece).second;
 
+	pthread_mutex_unlock(&lock);
 
-static void
-alert_queue_loop_destroy(void *data) {
-	Log *log = (Log *) data;
+	if (first)
+		event(TRACE_FIRST_BLOCK, piece);
+}
 
-	if (log)
-		delete log;
+int TorrentPieces::num_pieces() {
+	return handle.torrent_file()->num_pieces();
 }
 
-static void*
-alert_queue_loop(void *data) {
-	int oldstate, oldtype;
+bool TorrentPieces::have_piece(int piece) {
+	return handle.have_piece(piece);
+}
 
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &oldstate);
-	pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, &oldtype);
+int TorrentPieces::piece_priority(int piece) {
+	auto i = priorities.find(piece);
 
-	pthread_cleanup_push(&alert_queue_loop_destroy, data);
+	return i != priorities.end() ? i->second : 0;
+}
 
-	while (1) {
-		if (!session->wait_for_alert(libtorrent::seconds(1)))
-			continue;
+void TorrentPieces::piece_priority(int piece, int priority) {
+	handle.piece_priority(piece, priority);
 
-#if LIBTORRENT_VERSION_NUM < 10100
-		std::deque<libtorrent::alert*> alerts;
+	priorities[piece] = priority;
 
-		session->pop_alerts(&alerts);
+	if (trace)
+		trace->event(TRACE_PRIORITY, piece, priority);
 
-		for (std::deque<libtorrent::alert*>::iterator i =
-				alerts.begin(); i != alerts.end(); ++i) {
-			handle_alert(*i, (Log *) data);
-		}
-#else
-		std::vector<libtorrent::alert*> alerts;
+	if (priority >= WINDOW_PRIORITY) {
+		pthread_mutex_lock(&urgent_lock);
 
-		session->pop_alerts(&alerts);
+		urgent.insert(piece);
 
-		for (std::vector<libtorrent::alert*>::iterator i =
-				alerts.begin(); i != alerts.end(); ++i) {
-			handle_alert(*i, (Log *) data);
-		}
-#endif
+		pthread_mutex_unlock(&urgent_lock);
 	}
+}
 
-	pthread_cleanup_pop(1);
+void TorrentPieces::piece_deadline(int piece, int ms) {
+	handle.set_piece_deadline(piece, ms);
 
-	return NULL;
+	if (trace)
+		trace->event(TRACE_DEADLINE, piece, ms);
 }
 
-static bool
-is_root(const char *path) {
-	return strcmp(path, "/") == 0;
+void TorrentPieces::entered_window(int piece) {
+	if (trace)
+		trace->event(TRACE_WINDOW, piece);
 }
 
-static bool
-is_dir(const char *path) {
-	return dirs.find(path) != dirs.end();
-}
+void TorrentPieces::left_window(int piece, int priority) {
+	auto i = priorities.find(piece);
 
-static bool
-is_file(const char *path) {
-	return files.find(path) != files.end();
-}
+	// Unless another window or a prefetch has set it since
+	if (i == priorities.end() || i->second != priority)
+		return;
 
-static int
-btfs_getattr(const char *path, struct stat *stbuf,
-		struct fuse_file_info *fi) {
-	(void) fi;
-	if (!is_dir(path) && !is_file(path) && !is_root(path))
-		return -ENOENT;
+	// Give it the window priority again if the window comes back
+	priorities.erase(i);
 
-	pthread_mutex_lock(&lock);
+	pthread_mutex_lock(&urgent_lock);
 
-	memset(stbuf, 0, sizeof (*stbuf));
+	urgent.erase(piece);
 
-	stbuf->st_uid = getuid();
-	stbuf->st_gid = getgid();
-	stbuf->st_mtime = time_of_mount;
+	pthread_mutex_unlock(&urgent_lock);
+}
 
-	if (is_root(path) || is_dir(path)) {
-		stbuf->st_mode = S_IFDIR | 0755;
-	} else {
-		auto ti = handle.torrent_file();
+static bool
+is_downloaded(int index) {
+	auto ti = handle.torrent_file();
 
 #if LIBTORRENT_VERSION_NUM < 10100
-		int64_t file_size = ti->file_at(files[path]).size;
+	int64_t file_size = ti->file_at(index).size;
 #else
-		int64_t file_size = ti->files().file_size(files[path]);
+	int64_t file_size = ti->files().file_size(index);
 #endif
 
-#if LIBTORRENT_VERSION_NUM < 10200
-		std::vector<boost::int64_t> progress;
-#else
-		std::vector<std::int64_t> progress;
-#endif
+	if (file_size <= 0)
+		return true;
 
-		// Get number of bytes downloaded of each file
-		handle.file_progress(progress,
-			libtorrent::torrent_handle::piece_granularity);
+	int first = ti->map_file(index, 0, 0).piece;
+	int last = ti->map_file(index, file_size - 1, 1).piece;
 
-		stbuf->st_blocks = progress[(size_t) files[path]] / 512;
-		stbuf->st_mode = S_IFREG | 0444;
-		stbuf->st_size = file_size;
+	for (int i = first; i <= last; i++) {
+		if (!handle.have_piece(i))
+			return false;
 	}
 
-	pthread_mutex_unlock(&lock);
-
+	return true;
+}
+
+static int64_t
+available(int index, off_t offset) {
+	auto ti = handle.torrent_file();
+
+#if LIBTORRENT_VERSION_NUM < 10100
+	int64_t file_size = ti->file_at(index).size;
+#else
+	int64_t file_size = ti->files().file_size(index);
+#endif
+
+	if (offset >= file_size)
+		return 0;
+
+	libtorrent::peer_request part = ti->map_file(index, offset, 0);
+
+	int64_t n = 0;
+
+	// Sum up downloaded pieces until the first missing one
+	for (int i = part.piece; i < ti->num_pieces() && handle.have_piece(i);
+			i++) {
+		n += ti->piece_size(i) - (i == part.piece ? part.start : 0);
+
+		if (offset + n >= file_size)
+			return file_size - offset;
+	}
+
+	return n;
+}
+
+struct web_seed_buffer {
+	char *buf;
+	size_t size;
+	size_t filled;
+};
+
+static size_t
+handle_web_seed(void *contents, size_t size, size_t nmemb, void *userp) {
+	web_seed_buffer *output = (web_seed_buffer *) userp;
+
+	size_t n = std::min(nmemb * size, output->size - output->filled);
+
+	memcpy(output->buf + output->filled, contents, n);
+
+	output->filled += n;
+
+	// Abort the transfer once the requested range is complete, in case
+	// the server ignored the range and sent the whole file
+	return output->filled < output->size ? nmemb * size : 0;
+}
+
+static std::string
+web_seed_url(const std::string& seed, int index) {
+	auto ti = handle.torrent_file();
+
+	// A URL not ending with a slash is the file itself (single file only)
+	if (seed.empty() || seed[seed.length() - 1] != '/')
+		return ti->num_files() == 1 ? seed : std::string();
+
+	std::string url(seed);
+
+	std::string path = paths[(size_t) index];
+
+	std::string::size_type start = 0;
+
+	// Append each path component, URL escaped
+	while (start <= path.length()) {
+		std::string::size_type end = path.find('/', start);
+
+		if (end == std::string::npos)
+			end = path.length();
+
+		char *e = curl_easy_escape(NULL, path.c_str() + start,
+			(int) (end - start));
+
+		if (!e)
+			return std::string();
+
+		if (start > 0)
+			url += "/";
+
+		url += e;
+
+		curl_free(e);
+
+		start = end + 1;
+	}
+
+	return url;
+}
+
+// A range request for a byte range of a file, part of a piece
+struct web_seed_transfer {
+	// Position of the piece in the fetched pieces
+	size_t piece;
+
+	off_t offset;
+
+	web_seed_buffer output;
+
+	CURL *ch;
+};
+
+// Fetch pieces from a web seed into bufs, all byte ranges at the same
+// time. Returns which pieces were fetched completely.
+static std::vector<bool>
+fetch_web_seed(const std::string& seed, const std::vector<int>& pieces,
+		std::vector<std::vector<char>>& bufs) {
+	std::vector<bool> fetched(pieces.size(), false);
+
+	auto ti = handle.torrent_file();
+
+	CURLM *multi = curl_multi_init();
+
+	if (!multi)
+		return fetched;
+
+	std::list<web_seed_transfer> transfers;
+
+	fetched.assign(pieces.size(), true);
+
+	for (size_t i = 0; i < pieces.size(); i++) {
+		int size = ti->piece_size(pieces[i]);
+
+		bufs[i].assign((size_t) size, 0);
+
+		// A v1 piece may span several files
+		std::vector<libtorrent::file_slice> slices = ti->map_block(
+			pieces[i], 0, size);
+
+		size_t pos = 0;
+
+		for (size_t j = 0; j < slices.size(); j++) {
+			const libtorrent::file_slice& f = slices[j];
+
+			char *dest = bufs[i].data() + pos;
+
+			pos += (size_t) f.size;
+
+			// Padding is all zeros, and not on the mirror
+			if (ti->files().pad_file_at(f.file_index))
+				continue;
+
+			std::string url = web_seed_url(seed, f.file_index);
+
+			CURL *ch = url.empty() ? NULL : curl_easy_init();
+
+			if (!ch) {
+				fetched[i] = false;
+				continue;
+			}
+
+			transfers.push_back(web_seed_transfer());
+
+			web_seed_transfer& t = transfers.back();
+
+			t.piece = i;
+			t.offset = f.offset;
+			t.output = { dest, (size_t) f.size, 0 };
+			t.ch = ch;
+
+			std::ostringstream range;
+
+			range << f.offset << "-" << (f.offset + f.size - 1);
+
+			curl_easy_setopt(ch, CURLOPT_URL, url.c_str());
+			curl_easy_setopt(ch, CURLOPT_RANGE, range.str().c_str());
+			curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, handle_web_seed);
+			curl_easy_setopt(ch, CURLOPT_WRITEDATA, (void *) &t.output);
+			curl_easy_setopt(ch, CURLOPT_USERAGENT, "btfs/" VERSION);
+			curl_easy_setopt(ch, CURLOPT_FOLLOWLOCATION, 1);
+			curl_easy_setopt(ch, CURLOPT_FAILONERROR, 1);
+			curl_easy_setopt(ch, CURLOPT_NOSIGNAL, 1);
+			curl_easy_setopt(ch, CURLOPT_CONNECTTIMEOUT, 10);
+			curl_easy_setopt(ch, CURLOPT_TIMEOUT, 60);
+
+			curl_multi_add_handle(multi, ch);
+		}
+	}
+
+	int running = 0;
+
+	do {
+		if (curl_multi_perform(multi, &running) != CURLM_OK)
+			break;
+
+		if (running > 0 && curl_multi_wait(multi, NULL, 0, 1000,
+				NULL) != CURLM_OK)
+			break;
+	} while (running > 0);
+
+	for (std::list<web_seed_transfer>::iterator i = transfers.begin();
+			i != transfers.end(); ++i) {
+		long code = 0;
+
+		curl_easy_getinfo(i->ch, CURLINFO_RESPONSE_CODE, &code);
+
+		curl_multi_remove_handle(multi, i->ch);
+		curl_easy_cleanup(i->ch);
+
+		// A full (200) response is only usable if the range starts at zero
+		if (i->output.filled != i->output.size ||
+				(code != 206 && (code != 200 || i->offset != 0)))
+			fetched[i->piece] = false;
+	}
+
+	curl_multi_cleanup(multi);
+
+	return fetched;
+}
+
+#if LIBTORRENT_VERSION_NUM >= 10200
+int ReciprocityPeer::score(const std::set<int>& pieces) {
+	return choke_score(pieces, [this](int piece) {
+		return peer.has_piece(piece);
+	});
+}
+
+std::shared_ptr<libtorrent::peer_plugin> ReciprocityTorrent::new_connection(
+		libtorrent::peer_connection_handle const& p) {
+	std::shared_ptr<ReciprocityPeer> peer =
+		std::make_shared<ReciprocityPeer>(p);
+
+	peers.push_back(peer);
+
+	return peer;
+}
+
+void ReciprocityTorrent::tick() {
+	pthread_mutex_lock(&urgent_lock);
+
+	std::set<int> pieces = urgent;
+
+	pthread_mutex_unlock(&urgent_lock);
+
+	if (pieces.empty())
+		return;
+
+	std::vector<std::shared_ptr<ReciprocityPeer>> connected;
+	std::vector<choke_peer> state;
+
+	for (auto i = peers.begin(); i != peers.end();) {
+		std::shared_ptr<ReciprocityPeer> p = i->lock();
+
+		if (!p) {
+			i = peers.erase(i);
+			continue;
+		}
+
+		++i;
+
+		choke_peer c;
+
+		c.interested = p->peer.is_peer_interested();
+		c.choked = p->peer.is_choked();
+		c.score = c.interested ? p->score(pieces) : 0;
+
+		connected.push_back(p);
+		state.push_back(c);
+	}
+
+	choke_plan plan = plan_chokes(state);
+
+	for (size_t i = 0; i < plan.choke.size(); i++)
+		connected[plan.choke[i]]->peer.choke_this_peer();
+
+	for (size_t i = 0; i < plan.unchoke.size(); i++)
+		connected[plan.unchoke[i]]->peer.maybe_unchoke_this_peer();
+}
+
+#if LIBTORRENT_VERSION_NUM < 20000
+std::shared_ptr<libtorrent::torrent_plugin> Reciprocity::new_torrent(
+		libtorrent::torrent_handle const& h, void *userdata) {
+#else
+std::shared_ptr<libtorrent::torrent_plugin> Reciprocity::new_torrent(
+		libtorrent::torrent_handle const& h,
+		libtorrent::client_data_t userdata) {
+#endif
+	return std::make_shared<ReciprocityTorrent>();
+}
+#endif
+
+static bool
+is_ahead_of_reader(int piece) {
+	auto ti = handle.torrent_file();
+
+	for (opens_iter i = opens.begin(); i != opens.end(); ++i) {
+		File *f = *i;
+
+		if (f->position >= f->size)
+			continue;
+
+		int p = ti->map_file(f->index, f->base + f->position, 0).piece;
+
+		if (piece >= p && piece < p + WINDOW_SIZE)
+			return true;
+	}
+
+	return false;
+}
+
+// Start reading a finished piece into the cache, if a reader is about to
+// need it
+static void
+cache_piece(int piece) {
+	if (params.cache_size <= 0 || cache.count(piece) ||
+			caching.count(piece) || !is_ahead_of_reader(piece))
+		return;
+
+	caching.insert(piece);
+
+	handle.read_piece(piece);
+
+	if (trace)
+		trace->event(TRACE_READ_ISSUED, piece);
+}
+
+static void
+store_piece(int piece, const char *buf, int size) {
+	if (!caching.erase(piece) || cache.count(piece))
+		return;
+
+	cache[piece].assign(buf, buf + size);
+	cache_order.push_back(piece);
+	cache_bytes += size;
+
+	int64_t budget = (int64_t) params.cache_size << 20;
+
+	// Evict least recently used pieces, but never the new one
+	while (cache_bytes > budget && cache_order.front() != piece) {
+		cache_bytes -= (int64_t) cache[cache_order.front()].size();
+
+		cache.erase(cache_order.front());
+		cache_order.pop_front();
+	}
+}
+
+static std::vector<char> *
+cached_piece(int piece) {
+	std::map<int,std::vector<char>>::iterator i = cache.find(piece);
+
+	if (i == cache.end())
+		return NULL;
+
+	cache_order.remove(piece);
+	cache_order.push_back(piece);
+
+	return &i->second;
+}
+
+static std::string
+disk_path(int index) {
+	return save_paths[placement[(size_t) index]] + "/" + paths[(size_t) index];
+}
+
+int TorrentPieces::piece_size(int piece) {
+	return handle.torrent_file()->piece_size(piece);
+}
+
+int64_t TorrentPieces::file_size(int index) {
+	auto ti = handle.torrent_file();
+
+#if LIBTORRENT_VERSION_NUM < 10100
+	return ti->file_at(index).size;
+#else
+	return ti->files().file_size(index);
+#endif
+}
+
+void TorrentPieces::map_file(int index, int64_t offset, int& piece,
+		int& start) {
+	libtorrent::peer_request part = handle.torrent_file()->map_file(index,
+		offset, 0);
+
+	piece = part.piece;
+	start = part.start;
+}
+
+void TorrentPieces::read_piece(int piece) {
+	std::vector<char> *data = cached_piece(piece);
+
+	if (data) {
+		// No need to go through the disk and the alert queue
+		piece_read(piece, data->data(), (int) data->size(), false);
+	} else {
+		handle.read_piece(piece);
+
+		event(TRACE_READ_ISSUED, piece);
+	}
+}
+
+bool TorrentPieces::read_direct(Read *r, size_t part, int index,
+		off_t offset, int length) {
+#if LIBTORRENT_VERSION_NUM >= 20000
+	if (!disk_reader.running())
+		return false;
+
+	int piece, start;
+
+	map_file(index, offset, piece, start);
+
+	// Served from memory anyway
+	if (cache.count(piece))
+		return false;
+
+	std::map<int,int>::iterator i = disk_fds.find(index);
+
+	if (i == disk_fds.end()) {
+		int fd = open(disk_path(index).c_str(), O_RDONLY | O_CLOEXEC);
+
+		if (fd < 0)
+			return false;
+
+		i = disk_fds.insert(std::make_pair(index, fd)).first;
+	}
+
+	bool ok = disk_reader.submit(i->second, offset, length,
+			[this, r, part, piece](const char *data, int n) {
+		pthread_mutex_lock(&::lock);
+
+		// Under lock, so after the issue event below
+		event(TRACE_READ_DONE, piece, data ? 0 : -n);
+
+		r->direct_done(part, data, n);
+
+		pthread_cond_broadcast(&::signal_cond);
+
+		pthread_mutex_unlock(&::lock);
+	});
+
+	if (ok)
+		event(TRACE_READ_ISSUED, piece);
+
+	return ok;
+#else
+	// libtorrent 1.x may keep finished blocks in its write cache
+	return false;
+#endif
+}
+
+bool TorrentPieces::has_mirrors() {
+	return !web_seeds.empty();
+}
+
+// Fetch whole pieces from mirrors and hand them to libtorrent, which
+// hash checks them like pieces from peers. Called without lock held.
+void TorrentPieces::fetch(const std::vector<int>& pieces) {
+	std::vector<int> wanted;
+
+	pthread_mutex_lock(&::lock);
+
+	// Other reads may be fetching the same pieces
+	for (size_t i = 0; i < pieces.size(); i++) {
+		if (!handle.have_piece(pieces[i]) &&
+				mirror_pieces.insert(pieces[i]).second)
+			wanted.push_back(pieces[i]);
+	}
+
+	pthread_mutex_unlock(&::lock);
+
+	std::vector<std::vector<char>> bufs(wanted.size());
+	std::vector<bool> fetched(wanted.size(), false);
+
+	for (size_t i = 0; i < web_seeds.size(); i++) {
+		std::vector<int> missing;
+		std::vector<size_t> positions;
+
+		for (size_t j = 0; j < wanted.size(); j++) {
+			if (!fetched[j]) {
+				missing.push_back(wanted[j]);
+				positions.push_back(j);
+			}
+		}
+
+		if (missing.empty())
+			break;
+
+		std::vector<std::vector<char>> b(missing.size());
+
+		std::vector<bool> ok = fetch_web_seed(web_seeds[i], missing, b);
+
+		for (size_t j = 0; j < missing.size(); j++) {
+			if (ok[j]) {
+				fetched[positions[j]] = true;
+				bufs[positions[j]].swap(b[j]);
+			}
+		}
+	}
+
+	pthread_mutex_lock(&::lock);
+
+	for (size_t i = 0; i < wanted.size(); i++) {
+		// Finished through piece_finished_alert, or dropped through
+		// hash_failed_alert
+		if (fetched[i])
+			handle.add_piece(wanted[i], bufs[i].data());
+		else
+			mirror_pieces.erase(wanted[i]);
+	}
+
+	pthread_mutex_unlock(&::lock);
+}
+
+void TorrentPieces::event(trace_type type, int piece, int64_t value) {
+	if (trace)
+		trace->event(type, piece, value);
+}
+
+// Spread files over the data directories. Returns the absolute paths of
+// the files outside the first one, which libtorrent must be told about.
+static std::map<int,std::string>
+place_files(const libtorrent::torrent_info *ti) {
+	std::map<int,std::string> renamed;
+
+	placement.assign((size_t) ti->num_files(), 0);
+
+	if (save_paths.size() <= 1)
+		return renamed;
+
+	// Bytes left on each data directory's file system
+	std::vector<int64_t> space;
+
+	for (size_t i = 0; i < save_paths.size(); i++) {
+		struct statvfs st;
+
+		if (statvfs(save_paths[i].c_str(), &st) < 0)
+			space.push_back(0);
+		else
+			space.push_back((int64_t) (st.f_bavail * st.f_frsize));
+	}
+
+	bool free_space = params.placement &&
+		strcmp(params.placement, "free-space") == 0;
+
+	size_t next = 0;
+
+	for (int i = 0; i < ti->num_files(); ++i) {
+#if LIBTORRENT_VERSION_NUM >= 10100
+		if (ti->files().pad_file_at(i))
+			continue;
+
+		int64_t file_size = ti->files().file_size(i);
+#else
+		int64_t file_size = ti->file_at(i).size;
+#endif
+
+		size_t k = next++ % save_paths.size();
+
+		if (free_space)
+			k = (size_t) (std::max_element(space.begin(),
+				space.end()) - space.begin());
+
+		space[k] -= file_size;
+
+		placement[(size_t) i] = k;
+
+#if LIBTORRENT_VERSION_NUM < 10100
+		std::string path = ti->file_at(i).path;
+#else
+		std::string path = ti->files().file_path(i);
+#endif
+
+		// Absolute paths are not relative to the save path
+		if (k > 0)
+			renamed[i] = save_paths[k] + "/" + path;
+	}
+
+	return renamed;
+}
+
+static bool
+make_parents(const std::string& path) {
+	for (std::string::size_type i = path.find('/', 1);
+			i != std::string::npos; i = path.find('/', i + 1)) {
+		if (mkdir(path.substr(0, i).c_str(),
+				S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0) {
+			if (errno != EEXIST)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+// Copy a file, as a reflink where the file system can, so that writes to
+// one copy never reach the other
+static bool
+copy_file(const std::string& from, const std::string& to) {
+	int in = open(from.c_str(), O_RDONLY);
+
+	if (in < 0)
+		return false;
+
+	int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+	if (out < 0)
+		RETV(close(in), false);
+
+	bool ok = false;
+
+#ifdef FICLONE
+	ok = ioctl(out, FICLONE, in) == 0;
+#endif
+
+	std::vector<char> buf(1 << 20);
+
+	while (!ok) {
+		ssize_t n = read(in, buf.data(), buf.size());
+
+		if (n == 0) {
+			ok = true;
+		} else if (n < 0 || write(out, buf.data(), (size_t) n) != n) {
+			break;
+		}
+	}
+
+	ok = close(out) == 0 && ok;
+
+	close(in);
+
+	if (!ok)
+		unlink(to.c_str());
+
+	return ok;
+}
+
+#if LIBTORRENT_VERSION_NUM >= 20000
+static std::string
+store_file(const libtorrent::file_storage& fs, int i) {
+	if (store_path.empty() || fs.pad_file_at(i) || fs.root(i).is_all_zeros())
+		return std::string();
+
+	std::ostringstream path;
+
+	// Files are named by their BitTorrent v2 Merkle root
+	path << store_path << "/" << fs.root(i);
+
+	return path.str();
+}
+#endif
+
+// Copy files the store has into place, after place_files(), for
+// libtorrent to check when the torrent is added. libtorrent may write to
+// them, so they are never hard links. Called without lock held.
+static void
+link_from_store(const libtorrent::torrent_info *ti) {
+#if LIBTORRENT_VERSION_NUM >= 20000
+	const libtorrent::file_storage& fs = ti->files();
+
+	for (int i = 0; i < fs.num_files(); ++i) {
+		std::string from = store_file(fs, i);
+
+		if (from.empty())
+			continue;
+
+		struct stat st;
+
+		if (stat(from.c_str(), &st) < 0 || st.st_size != fs.file_size(i))
+			continue;
+
+		std::string to = save_paths[placement[(size_t) i]] + "/" +
+			fs.file_path(i);
+
+		if (make_parents(to))
+			copy_file(from, to);
+	}
+#endif
+}
+
+static void
+link_to_store(int index) {
+#if LIBTORRENT_VERSION_NUM >= 20000
+	auto ti = handle.torrent_file();
+
+	const libtorrent::file_storage& fs = ti->files();
+
+	std::string to = store_file(fs, index);
+
+	if (to.empty())
+		return;
+
+	// Fails harmlessly if the store already has this file, or is on
+	// another file system
+	if (link(disk_path(index).c_str(), to.c_str()) < 0)
+		return;
+
+	// The file is finished, but keeps its name in this torrent. Nothing
+	// may write to the store through either.
+	chmod(to.c_str(), S_IRUSR | S_IRGRP | S_IROTH);
+#endif
+}
+
+// Hand the pieces of files the store has to libtorrent, a few at a time,
+// so that it hash checks them like pieces from peers. Used for magnet
+// links, whose files can't be checked when the torrent is added.
+static void *
+import_from_store(void *data) {
+#if LIBTORRENT_VERSION_NUM >= 20000
+	pthread_mutex_lock(&lock);
+
+	libtorrent::torrent_handle h = handle;
+
+	pthread_mutex_unlock(&lock);
+
+	auto ti = h.torrent_file();
+
+	const libtorrent::file_storage& fs = ti->files();
+
+	bool stop = false;
+
+	for (int i = 0; i < fs.num_files() && !stop; ++i) {
+		std::string from = store_file(fs, i);
+
+		if (from.empty() || fs.file_size(i) <= 0)
+			continue;
+
+		int fd = open(from.c_str(), O_RDONLY);
+
+		if (fd < 0)
+			continue;
+
+		struct stat st;
+
+		if (fstat(fd, &st) < 0 || st.st_size != fs.file_size(i)) {
+			close(fd);
+			continue;
+		}
+
+		// Files of v2 torrents start at a piece boundary
+		int first = ti->map_file(i, 0, 0).piece;
+		int last = ti->map_file(i, fs.file_size(i) - 1, 1).piece;
+
+		for (int p = first; p <= last; p++) {
+			if (h.have_piece(p))
+				continue;
+
+			pthread_mutex_lock(&lock);
+
+			while (!store_stop && store_pieces.size() >= STORE_PIECES)
+				pthread_cond_wait(&signal_cond, &lock);
+
+			stop = store_stop;
+
+			if (!stop)
+				store_pieces.insert(p);
+
+			pthread_mutex_unlock(&lock);
+
+			if (stop)
+				break;
+
+			// Padding after the end of the file is zeros
+			std::vector<char> buf((size_t) ti->piece_size(p), 0);
+
+			off_t offset = (off_t) (p - first) * ti->piece_length();
+
+			size_t n = (size_t) std::min((int64_t) buf.size(),
+				fs.file_size(i) - offset);
+
+			if (pread(fd, buf.data(), n, offset) != (ssize_t) n) {
+				pthread_mutex_lock(&lock);
+				store_pieces.erase(p);
+				pthread_mutex_unlock(&lock);
+				break;
+			}
+
+			// Finished through piece_finished_alert, or dropped through
+			// hash_failed_alert
+			h.add_piece(p, buf.data());
+		}
+
+		close(fd);
+	}
+#endif
+
+	return NULL;
+}
+
+static bool
+is_readable(File *f) {
+	// End of file counts as readable too
+	return f->position >= f->size ||
+		available(f->index, f->base + f->position) > 0;
+}
+
+static void
+add_archives() {
+	auto ti = handle.torrent_file();
+
+	for (int i = 0; i < ti->num_files(); ++i) {
+		const std::string& path = paths[(size_t) i];
+
+		if (archive_type_of(path) == ARCHIVE_NONE ||
+				!files.count("/" + path))
+			continue;
+
+		std::string::size_type slash = path.rfind('/');
+
+		std::string parent = slash == std::string::npos ? "/" :
+			"/" + path.substr(0, slash);
+
+		// Members go in a directory next to the archive
+		std::string name = path.substr(slash == std::string::npos ?
+			0 : slash + 1) + ".d";
+
+		if (files.count("/" + path + ".d"))
+			continue;
+
+		dirs[parent].insert(name);
+		dirs["/" + path + ".d"];
+
+		archives["/" + path + ".d"] = i;
+	}
+}
+
+static void
+notify_polls() {
+	for (opens_iter i = opens.begin(); i != opens.end(); ++i) {
+		File *f = *i;
+
+		if (f->ph && is_readable(f)) {
+			fuse_notify_poll(f->ph);
+			fuse_pollhandle_destroy(f->ph);
+
+			f->ph = NULL;
+		}
+	}
+}
+
+static void
+notify_systemd(const char *state) {
+	const char *path = getenv("NOTIFY_SOCKET");
+
+	if (!path || strlen(path) < 2 || strlen(path) >= sizeof
+			(((struct sockaddr_un *) NULL)->sun_path))
+		return;
+
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof (addr));
+
+	addr.sun_family = AF_UNIX;
+
+	strcpy(addr.sun_path, path);
+
+	// Abstract socket
+	if (addr.sun_path[0] == '@')
+		addr.sun_path[0] = '\0';
+
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+		return;
+
+	if (sendto(fd, state, strlen(state), 0, (struct sockaddr *) &addr,
+			(socklen_t) (offsetof(struct sockaddr_un, sun_path) +
+			strlen(path))) < 0)
+		perror("Failed to notify systemd");
+
+	close(fd);
+}
+
+static void
+notify_ready() {
+	if (params.ready_fd >= 0) {
+		const char msg[] = "ready\n";
+
+		if (write(params.ready_fd, msg, sizeof (msg) - 1) < 0)
+			perror("Failed to write to ready fd");
+
+		close(params.ready_fd);
+
+		params.ready_fd = -1;
+	}
+
+	notify_systemd("READY=1");
+}
+
+// Pieces read by earlier mounts, see earlier_reads
+static std::map<int,std::pair<int64_t,int>>
+load_heatmap() {
+	std::map<int,std::pair<int64_t,int>> heat;
+
+	std::ifstream in(heatmap_path);
+
+	int piece, reads;
+	int64_t ms;
+
+	while (in >> piece >> ms >> reads)
+		heat[piece] = std::make_pair(ms, reads);
+
+	return heat;
+}
+
+// Give the pieces earlier mounts read deadlines as far after metadata
+// was loaded as they were read then, so that they are fetched in order
+static void
+schedule_heatmap() {
+	auto ti = handle.torrent_file();
+
+	for (auto i = earlier_reads.begin(); i != earlier_reads.end(); ++i) {
+		int piece = i->first;
+
+		if (piece < 0 || piece >= ti->num_pieces() ||
+				handle.have_piece(piece))
+			continue;
+
+		torrent_pieces.piece_deadline(piece,
+			(int) std::min(i->second.first, (int64_t) INT_MAX));
+	}
+}
+
+static void
+record_read(int index, off_t offset, size_t size) {
+	if (heatmap_path.empty() || size == 0 ||
+			first_reads.size() >= HEATMAP_PIECES)
+		return;
+
+	auto ti = handle.torrent_file();
+
+	int first = ti->map_file(index, offset, 0).piece;
+	int last = ti->map_file(index, offset + (off_t) size - 1, 0).piece;
+
+	int64_t ms = (int64_t) (now_us() - loaded_us) / 1000;
+
+	for (int i = first; i <= last && first_reads.size() < HEATMAP_PIECES;
+			i++)
+		first_reads.insert(std::make_pair(i, ms));
+}
+
+// Merge the reads of this mount into the heatmap of earlier mounts.
+// Called again with more reads later, so this mount counts only once.
+static void
+save_heatmap(const std::map<int,int64_t>& reads) {
+	std::map<int,std::pair<int64_t,int>> heat = earlier_reads;
+
+	for (auto i = reads.begin(); i != reads.end(); ++i) {
+		std::pair<int64_t,int>& h = heat[i->first];
+
+		h.first = (h.first * h.second + i->second) / (h.second + 1);
+		h.second++;
+	}
+
+	std::vector<std::pair<int,std::pair<int64_t,int>>> sorted(heat.begin(),
+		heat.end());
+
+	// Keep the pieces most mounts read, early ones first
+	std::sort(sorted.begin(), sorted.end(), [](
+			const std::pair<int,std::pair<int64_t,int>>& a,
+			const std::pair<int,std::pair<int64_t,int>>& b) {
+		if (a.second.second != b.second.second)
+			return a.second.second > b.second.second;
+
+		return a.second.first < b.second.first;
+	});
+
+	if (sorted.size() > HEATMAP_PIECES)
+		sorted.resize(HEATMAP_PIECES);
+
+	std::string tmp = heatmap_path + ".tmp";
+
+	std::ofstream out(tmp);
+
+	for (size_t i = 0; i < sorted.size(); i++) {
+		out << sorted[i].first << " " << sorted[i].second.first << " " <<
+			sorted[i].second.second << "\n";
+	}
+
+	out.close();
+
+	if (!out || rename(tmp.c_str(), heatmap_path.c_str()) < 0)
+		unlink(tmp.c_str());
+}
+
+// Whether path, or a directory it is in, matches one of globs
+static bool
+matches_any(const std::string& path, const std::vector<std::string>& globs) {
+	for (size_t i = 0; i < globs.size(); i++) {
+		std::string::size_type end = 0;
+
+		do {
+			end = path.find('/', end + 1);
+
+			if (fnmatch(globs[i].c_str(), path.substr(0, end).c_str(),
+					0) == 0)
+				return true;
+		} while (end != std::string::npos);
+	}
+
+	return false;
+}
+
+// Whether a file of the torrent is part of the mount
+static bool
+is_selected(const std::string& path) {
+	if (!include_args.empty() && !matches_any(path, include_args))
+		return false;
+
+	return !matches_any(path, exclude_args);
+}
+
+static void
+setup() {
+	printf("Got metadata. Now ready to start downloading.\n");
+
+	auto ti = handle.torrent_file();
+
+	if (params.browse_only)
+		handle.pause();
+
+	// Both web seeds from the command line and from the metadata
+	std::set<std::string> seeds = handle.url_seeds();
+
+	web_seeds.assign(seeds.begin(), seeds.end());
+
+#if LIBTORRENT_VERSION_NUM < 10200
+	std::vector<int> priorities((size_t) ti->num_files(), 4);
+#else
+	std::vector<libtorrent::download_priority_t> priorities(
+		(size_t) ti->num_files(), libtorrent::default_priority);
+#endif
+
+	bool skipped = false;
+
+	for (int i = 0; i < ti->num_files(); ++i) {
+		std::string parent("");
+
+#if LIBTORRENT_VERSION_NUM < 10100
+		std::string path = ti->file_at(i).path;
+#else
+		std::string path = ti->files().file_path(i);
+#endif
+
+		// Files are indexed by file index, selected or not
+		paths.push_back(path);
+
+		if (!is_selected(path)) {
+#if LIBTORRENT_VERSION_NUM < 10200
+			priorities[(size_t) i] = 0;
+#else
+			priorities[(size_t) i] = libtorrent::dont_download;
+#endif
+			skipped = true;
+
+			continue;
+		}
+
+		char *p = strdup(path.c_str());
+
+		if (!p)
+			continue;
+
+		for (char *x = strtok(p, "/"); x; x = strtok(NULL, "/")) {
+			if (strlen(x) <= 0)
+				continue;
+
+			if (parent.length() <= 0)
+				// Root dir <-> children mapping
+				dirs["/"].insert(x);
+			else
+				// Non-root dir <-> children mapping
+				dirs[parent].insert(x);
+
+			parent += "/";
+			parent += x;
+		}
+
+		free(p);
+
+		// Path <-> file index mapping
+		files["/" + path] = i;
+	}
+
+	if (skipped)
+		handle.prioritize_files(priorities);
+
+	// Unless done before the torrent was added
+	if (placement.empty()) {
+		std::map<int,std::string> renamed = place_files(ti.get());
+
+		for (auto i = renamed.begin(); i != renamed.end(); ++i)
+			handle.rename_file(i->first, i->second);
+	}
+
+	if (params.archives)
+		add_archives();
+
+	if (access_log.is_open()) {
+		// Torrent layout, so that btfssim needs no metadata
+		access_log << "torrent " << ti->piece_length() << " " <<
+			ti->num_pieces() << " " << ti->total_size() << std::endl;
+
+		for (int i = 0; i < ti->num_files(); ++i) {
+			access_log << "file " << i << " " <<
+				ti->files().file_offset(i) << " " <<
+				ti->files().file_size(i) << std::endl;
+		}
+	}
+
+	loaded = true;
+
+	loaded_us = now_us();
+
+	if (!heatmap_path.empty())
+		earlier_reads = load_heatmap();
+
+	if (!heatmap_path.empty() && !params.browse_only)
+		schedule_heatmap();
+
+	notify_ready();
+
+	// Wake up lookups waiting for the file tree
+	pthread_cond_broadcast(&signal_cond);
+}
+
+static void
+handle_read_piece_alert(libtorrent::read_piece_alert *a, Log *log) {
+	printf("%s: piece %d size %d\n", __func__, static_cast<int>(a->piece),
+		a->size);
+
+	if (trace)
+		trace->event(TRACE_READ_DONE, a->piece, a->ec.value());
+
+	pthread_mutex_lock(&lock);
+
+	torrent_pieces.piece_read(a->piece, a->buffer.get(), a->size,
+		(bool) a->ec);
+
+	if (a->ec) {
+		*log << a->message() << std::endl;
+
+		caching.erase(a->piece);
+	} else {
+		store_piece(a->piece, a->buffer.get(), a->size);
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	// Wake up all threads waiting for download
+	pthread_cond_broadcast(&signal_cond);
+}
+
+static void
+handle_hash_failed_alert(libtorrent::hash_failed_alert *a, Log *log) {
+	pthread_mutex_lock(&lock);
+
+	// A mirror sent bad data, let the read fetch it again later
+	mirror_pieces.erase(a->piece_index);
+
+	// Or the store did, the swarm has to provide this piece
+	store_pieces.erase(a->piece_index);
+
+	pthread_mutex_unlock(&lock);
+
+	pthread_cond_broadcast(&signal_cond);
+}
+
+static void
+handle_piece_finished_alert(libtorrent::piece_finished_alert *a, Log *log) {
+	printf("%s: %d\n", __func__, static_cast<int>(a->piece_index));
+
+	if (trace)
+		trace->event(TRACE_FINISHED, a->piece_index);
+
+	pthread_mutex_lock(&urgent_lock);
+
+	urgent.erase(a->piece_index);
+
+	pthread_mutex_unlock(&urgent_lock);
+
+	pthread_mutex_lock(&lock);
+
+	mirror_pieces.erase(a->piece_index);
+	store_pieces.erase(a->piece_index);
+
+	torrent_pieces.piece_finished(a->piece_index);
+
+	// Have the piece in memory before a sequential reader asks for it
+	cache_piece(a->piece_index);
+
+	// Wake up pollers waiting for this data
+	notify_polls();
+
+	// And exporters waiting for any data
+	pieces_finished++;
+
+	pthread_cond_broadcast(&signal_cond);
+
+	// Advance sliding windows
+	window.advance();
+	background.advance();
+
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+handle_block_finished_alert(libtorrent::block_finished_alert *a, Log *log) {
+	if (trace)
+		trace->block(a->piece_index);
+}
+
+static void
+handle_file_completed_alert(libtorrent::file_completed_alert *a, Log *log) {
+	pthread_mutex_lock(&lock);
+
+	link_to_store(static_cast<int>(a->index));
+
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+connect_static_peers(const libtorrent::torrent_handle& h) {
+	std::vector<libtorrent::peer_info> peers;
+
+	h.get_peer_info(peers);
+
+	for (size_t i = 0; i < static_peers.size(); i++) {
+		bool connected = false;
+
+		// Incoming connections have some other port, so go by address
+		for (size_t j = 0; j < peers.size() && !connected; j++)
+			connected = peers[j].ip.address() ==
+				static_peers[i].address();
+
+		if (!connected)
+			h.connect_peer(static_peers[i]);
+	}
+}
+
+static void
+handle_torrent_added_alert(libtorrent::torrent_added_alert *a, Log *log) {
+	if (params.cluster)
+		// Only talk to the static peers
+		a->handle.replace_trackers(
+			std::vector<libtorrent::announce_entry>());
+
+	connect_static_peers(a->handle);
+
+	pthread_mutex_lock(&lock);
+
+	handle = a->handle;
+
+	if (a->handle.status().has_metadata)
+		setup();
+
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+handle_metadata_received_alert(libtorrent::metadata_received_alert *a,
+		Log *log) {
+	pthread_mutex_lock(&lock);
+
+	handle = a->handle;
+
+	setup();
+
+	if (!store_path.empty() && !store_stop) {
+		pthread_create(&store_thread, NULL, import_from_store, NULL);
+
+		store_importing = true;
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+handle_alert(libtorrent::alert *a, Log *log) {
+	switch (a->type()) {
+	case libtorrent::read_piece_alert::alert_type:
+		handle_read_piece_alert(
+			(libtorrent::read_piece_alert *) a, log);
+		break;
+	case libtorrent::piece_finished_alert::alert_type:
+		*log << a->message() << std::endl;
+		handle_piece_finished_alert(
+			(libtorrent::piece_finished_alert *) a, log);
+		break;
+	case libtorrent::block_finished_alert::alert_type:
+		handle_block_finished_alert(
+			(libtorrent::block_finished_alert *) a, log);
+		break;
+	case libtorrent::hash_failed_alert::alert_type:
+		*log << a->message() << std::endl;
+		handle_hash_failed_alert(
+			(libtorrent::hash_failed_alert *) a, log);
+		break;
+	case libtorrent::file_completed_alert::alert_type:
+		*log << a->message() << std::endl;
+		handle_file_completed_alert(
+			(libtorrent::file_completed_alert *) a, log);
+		break;
+	case libtorrent::metadata_received_alert::alert_type:
+		*log << a->message() << std::endl;
+		handle_metadata_received_alert(
+			(libtorrent::metadata_received_alert *) a, log);
+		break;
+	case libtorrent::torrent_added_alert::alert_type:
+		*log << a->message() << std::endl;
+		handle_torrent_added_alert(
+			(libtorrent::torrent_added_alert *) a, log);
+		break;
+	case libtorrent::dht_bootstrap_alert::alert_type:
+		*log << a->message() << std::endl;
+		// Force DHT announce because libtorrent won't by itself
+		handle.force_dht_announce();
+		break;
+	case libtorrent::dht_announce_alert::alert_type:
+	case libtorrent::dht_reply_alert::alert_type:
+	case libtorrent::metadata_failed_alert::alert_type:
+	case libtorrent::tracker_announce_alert::alert_type:
+	case libtorrent::tracker_reply_alert::alert_type:
+	case libtorrent::tracker_warning_alert::alert_type:
+	case libtorrent::tracker_error_alert::alert_type:
+	case libtorrent::lsd_peer_alert::alert_type:
+		*log << a->message() << std::endl;
+		break;
+	case libtorrent::stats_alert::alert_type:
+		//*log << a->message() << std::endl;
+		break;
+	default:
+		break;
+	}
+
+#if LIBTORRENT_VERSION_NUM < 10100
+	delete a;
+#endif
+}
+
+
+static void
+alert_queue_loop_destroy(void *data) {
+	Log *log = (Log *) data;
+
+	if (log)
+		delete log;
+}
+
+static void*
+alert_queue_loop(void *data) {
+	int oldstate, oldtype;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &oldstate);
+	pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, &oldtype);
+
+	pthread_cleanup_push(&alert_queue_loop_destroy, data);
+
+	while (1) {
+		// Bring back static peers that have dropped, every few seconds
+		if (params.cluster && handle.is_valid() &&
+				time(NULL) - reconnected >= 5) {
+			connect_static_peers(handle);
+
+			reconnected = time(NULL);
+		}
+
+		// Save the heatmap now and then, in case btfs never gets to
+		// btfs_destroy()
+		if (!heatmap_path.empty() &&
+				time(NULL) - heatmap_saved >= HEATMAP_INTERVAL) {
+			std::map<int,int64_t> reads;
+
+			pthread_mutex_lock(&lock);
+
+			bool changed = first_reads.size() != saved_reads;
+
+			if (changed) {
+				reads = first_reads;
+				saved_reads = first_reads.size();
+			}
+
+			pthread_mutex_unlock(&lock);
+
+			if (changed)
+				save_heatmap(reads);
+
+			heatmap_saved = time(NULL);
+		}
+
+		if (!session->wait_for_alert(libtorrent::seconds(1)))
+			continue;
+
+#if LIBTORRENT_VERSION_NUM < 10100
+		std::deque<libtorrent::alert*> alerts;
+
+		session->pop_alerts(&alerts);
+
+		for (std::deque<libtorrent::alert*>::iterator i =
+				alerts.begin(); i != alerts.end(); ++i) {
+			handle_alert(*i, (Log *) data);
+		}
+#else
+		std::vector<libtorrent::alert*> alerts;
+
+		session->pop_alerts(&alerts);
+
+		for (std::vector<libtorrent::alert*>::iterator i =
+				alerts.begin(); i != alerts.end(); ++i) {
+			handle_alert(*i, (Log *) data);
+		}
+#endif
+	}
+
+	pthread_cleanup_pop(1);
+
+	return NULL;
+}
+
+static bool
+is_root(const char *path) {
+	return strcmp(path, "/") == 0;
+}
+
+// Archive directories and members are added at runtime, under the lock,
+// so these two take it. Code holding it looks at the maps directly.
+static bool
+is_dir(const char *path) {
+	pthread_mutex_lock(&lock);
+
+	bool found = dirs.find(path) != dirs.end();
+
+	pthread_mutex_unlock(&lock);
+
+	return found;
+}
+
+static bool
+is_file(const char *path) {
+	return files.find(path) != files.end();
+}
+
+static bool
+is_member(const char *path) {
+	pthread_mutex_lock(&lock);
+
+	bool found = members.find(path) != members.end();
+
+	pthread_mutex_unlock(&lock);
+
+	return found;
+}
+
+#ifdef HAVE_PASSTHROUGH
+static int
+open_backing(int index) {
+	std::string path = disk_path(index);
+
+	int fd = open(path.c_str(), O_RDONLY);
+
+	if (fd < 0)
+		return -1;
+
+	struct fuse_backing_map map;
+	memset(&map, 0, sizeof (map));
+
+	map.fd = fd;
+
+	int session_fd = fuse_session_fd(fuse_get_session(
+		fuse_get_context()->fuse));
+
+	// The kernel holds its own reference to the file
+	int backing_id = ioctl(session_fd, FUSE_DEV_IOC_BACKING_OPEN, &map);
+
+	close(fd);
+
+	return backing_id;
+}
+
+static void
+close_backing(int backing_id) {
+	uint32_t id = (uint32_t) backing_id;
+
+	int session_fd = fuse_session_fd(fuse_get_session(
+		fuse_get_context()->fuse));
+
+	ioctl(session_fd, FUSE_DEV_IOC_BACKING_CLOSE, &id);
+}
+#endif
+
+#if LIBTORRENT_VERSION_NUM < 10200
+typedef std::vector<boost::int64_t> progress_t;
+#else
+typedef std::vector<std::int64_t> progress_t;
+#endif
+
+static progress_t
+file_progress() {
+	progress_t progress;
+
+	// Get number of bytes downloaded of each file
+	handle.file_progress(progress,
+		libtorrent::torrent_handle::piece_granularity);
+
+	return progress;
+}
+
+static void
+fill_stat(const std::string& path, struct stat *stbuf,
+		const progress_t& progress) {
+	memset(stbuf, 0, sizeof (*stbuf));
+
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_mtime = time_of_mount;
+
+	auto member = members.find(path);
+
+	if (is_root(path.c_str()) || dirs.count(path)) {
+		stbuf->st_mode = S_IFDIR | 0755;
+	} else if (member != members.end()) {
+		const Member& m = member->second;
+
+		if (is_downloaded(m.index))
+			stbuf->st_blocks = m.entry.size / 512;
+
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_size = m.entry.size;
+	} else {
+		auto ti = handle.torrent_file();
+
+		int index = files[path];
+
+#if LIBTORRENT_VERSION_NUM < 10100
+		int64_t file_size = ti->file_at(index).size;
+#else
+		int64_t file_size = ti->files().file_size(index);
+#endif
+
+		stbuf->st_blocks = progress[(size_t) index] / 512;
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_size = file_size;
+	}
+}
+
+// Forget processes that have exited since they set their class, before
+// their pid is reused. Called with lock held.
+static void
+prune_background_pids() {
+	for (std::map<pid_t,bool>::iterator i = background_pids.begin();
+			i != background_pids.end();) {
+		if (kill(i->first, 0) < 0 && errno == ESRCH)
+			i = background_pids.erase(i);
+		else
+			++i;
+	}
+}
+
+static bool
+is_background() {
+	struct fuse_context *ctx = fuse_get_context();
+
+	std::map<pid_t,bool>::iterator i = background_pids.find(ctx->pid);
+
+	// An explicit tag wins over the uid rule
+	if (i != background_pids.end())
+		return i->second;
+
+	return params.background_uid >= 0 &&
+		ctx->uid == (uid_t) params.background_uid;
+}
+
+static Window&
+reader_window() {
+	return is_background() ? background : window;
+}
+
+static int
+read_range(int index, char *buf, off_t offset, size_t size, bool nonblock) {
+	return torrent_pieces.read(buf, index, offset, size, reader_window(),
+		nonblock);
+}
+
+static archive_reader
+archive_reader_for(int index) {
+	return [index](int64_t offset, size_t length, std::vector<char>& buf) {
+		buf.resize(length);
+
+		pthread_mutex_lock(&lock);
+
+		size_t got = 0;
+
+		// Short reads mode may return less than asked for
+		while (got < length) {
+			int s = read_range(index, buf.data() + got,
+				(off_t) (offset + (int64_t) got), length - got,
+				false);
+
+			if (s <= 0)
+				break;
+
+			got += (size_t) s;
+		}
+
+		pthread_mutex_unlock(&lock);
+
+		return got == length;
+	};
+}
+
+static void
+index_archive(const std::string& dir, int index) {
+	auto ti = handle.torrent_file();
+
+#if LIBTORRENT_VERSION_NUM < 10100
+	int64_t file_size = ti->file_at(index).size;
+#else
+	int64_t file_size = ti->files().file_size(index);
+#endif
+
+	archive_reader read = archive_reader_for(index);
+
+	std::vector<archive_entry> entries;
+
+	// Only reads the index, i.e. the pieces it is in
+	if (archive_type_of(paths[(size_t) index]) == ARCHIVE_ZIP)
+		list_zip(read, file_size, entries);
+	else
+		list_tar(read, file_size, entries);
+
+	pthread_mutex_lock(&lock);
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		std::string parent = dir;
+		std::string path = dir + "/" + entries[i].name;
+
+		// Directories between the archive directory and the member
+		for (std::string::size_type j = entries[i].name.find('/');
+				j != std::string::npos;
+				j = entries[i].name.find('/', j + 1)) {
+			std::string d = dir + "/" + entries[i].name.substr(0, j);
+
+			dirs[parent].insert(d.substr(parent.length() + 1));
+			dirs[d];
+
+			parent = d;
+		}
+
+		if (dirs.count(path))
+			continue;
+
+		dirs[parent].insert(path.substr(parent.length() + 1));
+
+		Member m;
+
+		m.index = index;
+		m.entry = entries[i];
+
+		members[path] = m;
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+index_archives(const char *path) {
+	if (archives.empty() || params.browse_only)
+		return;
+
+	std::string p(path);
+
+	for (std::map<std::string,int>::iterator i = archives.begin();
+			i != archives.end(); ++i) {
+		const std::string& dir = i->first;
+
+		if (p != dir && p.compare(0, dir.length() + 1, dir + "/") != 0)
+			continue;
+
+		pthread_mutex_lock(&lock);
+
+		// Someone else is listing this archive, wait for it
+		while (indexing.count(dir) && !indexed.count(dir))
+			pthread_cond_wait(&signal_cond, &lock);
+
+		bool todo = !indexed.count(dir);
+
+		indexing.insert(dir);
+
+		pthread_mutex_unlock(&lock);
+
+		if (!todo)
+			continue;
+
+		index_archive(dir, i->second);
+
+		pthread_mutex_lock(&lock);
+
+		indexed.insert(dir);
+
+		pthread_mutex_unlock(&lock);
+
+		pthread_cond_broadcast(&signal_cond);
+	}
+}
+
+static void
+wait_for_metadata() {
+	if (params.metadata_wait <= 0)
+		return;
+
+	struct timespec deadline = deadline_after(params.metadata_wait);
+
+	pthread_mutex_lock(&lock);
+
+	while (!loaded && pthread_cond_timedwait(&signal_cond, &lock,
+			&deadline) != ETIMEDOUT);
+
+	pthread_mutex_unlock(&lock);
+}
+
+static int
+btfs_getattr(const char *path, struct stat *stbuf,
+		struct fuse_file_info *fi) {
+	(void) fi;
+
+	// Lookups in the root, so the tree is not seen empty
+	if (!is_root(path))
+		wait_for_metadata();
+
+	index_archives(path);
+
+	if (!is_dir(path) && !is_file(path) && !is_root(path) &&
+			!is_member(path))
+		return -ENOENT;
+
+	pthread_mutex_lock(&lock);
+
+	fill_stat(path, stbuf, is_file(path) ? file_progress() : progress_t());
+
+	pthread_mutex_unlock(&lock);
+
 	return 0;
 }
 
 static int
-btfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		off_t offset, struct fuse_file_info *fi,
-		enum fuse_readdir_flags flags) {
-	(void)flags;
+btfs_opendir(const char *path, struct fuse_file_info *fi) {
+	wait_for_metadata();
+
+	index_archives(path);
+
 	if (!is_dir(path) && !is_file(path) && !is_root(path))
 		return -ENOENT;
 
@@ -483,12 +2154,62 @@ btfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 	pthread_mutex_lock(&lock);
 
-	filler(buf, ".", NULL, 0, (enum fuse_fill_dir_flags)0);
-	filler(buf, "..", NULL, 0, (enum fuse_fill_dir_flags)0);
+	// Snapshot of the children, so that readdir can resume at any offset
+	fi->fh = (uint64_t) new std::vector<std::string>(dirs[path].begin(),
+		dirs[path].end());
+
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+static int
+btfs_releasedir(const char *path, struct fuse_file_info *fi) {
+	delete (std::vector<std::string> *) fi->fh;
+
+	return 0;
+}
+
+static int
+btfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		off_t offset, struct fuse_file_info *fi,
+		enum fuse_readdir_flags flags) {
+	std::vector<std::string> *children =
+		(std::vector<std::string> *) fi->fh;
+
+	bool plus = (flags & FUSE_READDIR_PLUS) != 0;
+
+	std::string parent(is_root(path) ? "" : path);
+
+	pthread_mutex_lock(&lock);
+
+	// Downloaded bytes of all files at once, not once per file
+	progress_t progress = plus ? file_progress() : progress_t();
+
+	// Offset 0 and 1 are "." and "..", then the children in order
+	for (size_t i = (size_t) offset; i < children->size() + 2; i++) {
+		int full;
+
+		if (i < 2) {
+			full = filler(buf, i == 0 ? "." : "..", NULL,
+				(off_t) i + 1, (enum fuse_fill_dir_flags) 0);
+		} else if (plus) {
+			const std::string& name = (*children)[i - 2];
+
+			struct stat st;
 
-	for (std::set<std::string>::iterator i = dirs[path].begin();
-			i != dirs[path].end(); ++i) {
-		filler(buf, i->c_str(), NULL, 0, (enum fuse_fill_dir_flags)0);
+			fill_stat(parent + "/" + name, &st, progress);
+
+			full = filler(buf, name.c_str(), &st, (off_t) i + 1,
+				FUSE_FILL_DIR_PLUS);
+		} else {
+			full = filler(buf, (*children)[i - 2].c_str(), NULL,
+				(off_t) i + 1, (enum fuse_fill_dir_flags) 0);
+		}
+
+		// Buffer is full, the kernel continues from this offset later
+		if (full)
+			break;
 	}
 
 	pthread_mutex_unlock(&lock);
@@ -496,9 +2217,44 @@ btfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	return 0;
 }
 
+static int
+open_member(const char *path, struct fuse_file_info *fi) {
+	pthread_mutex_lock(&lock);
+
+	Member m = members[path];
+
+	pthread_mutex_unlock(&lock);
+
+	// Find the data of a zip member, once
+	if (!m.entry.resolved && (params.browse_only ||
+			!resolve_zip(archive_reader_for(m.index), m.entry)))
+		return -EIO;
+
+	pthread_mutex_lock(&lock);
+
+	members[path] = m;
+
+	File *f = new File(m.index, m.entry.size, (off_t) m.entry.offset);
+
+	opens.push_back(f);
+
+	if (params.short_reads || params.max_read_wait > 0)
+		fi->direct_io = 1;
+	else
+		fi->keep_cache = 1;
+
+	pthread_mutex_unlock(&lock);
+
+	fi->fh = (uint64_t) f;
+
+	return 0;
+}
+
 static int
 btfs_open(const char *path, struct fuse_file_info *fi) {
-	if (!is_dir(path) && !is_file(path))
+	index_archives(path);
+
+	if (!is_dir(path) && !is_file(path) && !is_member(path))
 		return -ENOENT;
 
 	if (is_dir(path))
@@ -507,38 +2263,247 @@ btfs_open(const char *path, struct fuse_file_info *fi) {
 	if ((fi->flags & 3) != O_RDONLY)
 		return -EACCES;
 
-	return 0;
-}
+	if (is_member(path))
+		return open_member(path, fi);
+
+	pthread_mutex_lock(&lock);
+
+	auto ti = handle.torrent_file();
+
+	int index = files[path];
+
+#if LIBTORRENT_VERSION_NUM < 10100
+	File *f = new File(index, ti->file_at(index).size);
+#else
+	File *f = new File(index, ti->files().file_size(index));
+#endif
+
+	opens.push_back(f);
+
+#ifdef HAVE_PASSTHROUGH
+	// Let the kernel serve fully downloaded files from the backing file
+	if (passthrough && !params.browse_only && is_downloaded(f->index)) {
+		int backing_id = open_backing(f->index);
+
+		if (backing_id > 0)
+			fi->backing_id = f->backing_id = backing_id;
+	}
+#endif
+
+	// Short reads would be taken for end of file by the page cache
+	if (!f->backing_id && (params.short_reads || params.max_read_wait > 0))
+		fi->direct_io = 1;
+
+	// Torrent data never changes, so the page cache of an earlier open
+	// stays valid
+	if (!fi->direct_io)
+		fi->keep_cache = 1;
+
+	pthread_mutex_unlock(&lock);
+
+	fi->fh = (uint64_t) f;
+
+	return 0;
+}
+
+static int
+btfs_release(const char *path, struct fuse_file_info *fi) {
+	File *f = (File *) fi->fh;
+
+	pthread_mutex_lock(&lock);
+
+	opens.remove(f);
+
+	// Files are closed when a process exits
+	prune_background_pids();
+
+	pthread_mutex_unlock(&lock);
+
+#ifdef HAVE_PASSTHROUGH
+	if (f->backing_id > 0)
+		close_backing(f->backing_id);
+#endif
+
+	if (f->ph)
+		fuse_pollhandle_destroy(f->ph);
+
+	delete f;
+
+	return 0;
+}
+
+static int
+btfs_read(const char *path, char *buf, size_t size, off_t offset,
+		struct fuse_file_info *fi) {
+	if (!is_dir(path) && !is_file(path) && !is_member(path))
+		return -ENOENT;
+
+	if (is_dir(path))
+		return -EISDIR;
+
+	if (params.browse_only)
+		return -EACCES;
+
+	File *f = (File *) fi->fh;
+
+	if (offset >= f->size)
+		return 0;
+
+	// Archive members end before the end of the archive
+	size = (size_t) std::min((int64_t) size, f->size - offset);
+
+	uint64_t start = now_us();
+
+	pthread_mutex_lock(&lock);
+
+	record_read(f->index, f->base + offset, size);
+
+	int s = read_range(f->index, buf, f->base + offset, size,
+		(fi->flags & O_NONBLOCK) != 0);
+
+	if (s > 0)
+		f->position = offset + s;
+
+	if (access_log.is_open())
+		access_log << "read " << start << " " << (now_us() - start) <<
+			" " << f->index << " " << (f->base + offset) << " " <<
+			size << "\n";
+
+	pthread_mutex_unlock(&lock);
+
+	return s;
+}
+
+static int
+btfs_poll(const char *path, struct fuse_file_info *fi,
+		struct fuse_pollhandle *ph, unsigned *reventsp) {
+	File *f = (File *) fi->fh;
+
+	pthread_mutex_lock(&lock);
+
+	if (is_readable(f)) {
+		*reventsp |= POLLIN | POLLRDNORM;
+
+		if (ph)
+			fuse_pollhandle_destroy(ph);
+	} else {
+		// Make sure the data being waited for is downloaded
+		if (!params.browse_only)
+			reader_window().jump(handle.torrent_file()->map_file(
+				f->index, f->base + f->position, 0).piece, 0);
+
+		// Replace any earlier poll handle, only the latest is notified
+		if (f->ph)
+			fuse_pollhandle_destroy(f->ph);
+
+		f->ph = ph;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+// Block until a piece finishes, unless one did since w->finished
+static int
+wait_for_piece(struct btfs_wait *w) {
+	if (w->timeout < 0)
+		return -EINVAL;
+
+	struct timespec deadline = deadline_after((int) std::min(w->timeout,
+		(int64_t) INT_MAX));
+
+	pthread_mutex_lock(&lock);
+
+	while (pieces_finished == w->finished &&
+			pthread_cond_timedwait(&signal_cond, &lock,
+			&deadline) != ETIMEDOUT);
+
+	w->finished = pieces_finished;
+
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+static int
+btfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+		unsigned int flags, void *data) {
+	if (flags & FUSE_IOCTL_COMPAT)
+		return -ENOSYS;
+
+	if (flags & FUSE_IOCTL_DIR)
+		return -ENOTTY;
+
+	if ((unsigned int) cmd == BTFS_IOC_WAIT)
+		return wait_for_piece((struct btfs_wait *) data);
+
+	if ((unsigned int) cmd != BTFS_IOC_AVAILABLE)
+		return -ENOTTY;
+
+	File *f = (File *) fi->fh;
+
+	struct btfs_available *a = (struct btfs_available *) data;
+
+	if (a->offset < 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&lock);
+
+	a->length = std::min(available(f->index, f->base + (off_t) a->offset),
+		std::max(f->size - a->offset, (int64_t) 0));
+
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+// Offset of the first downloaded byte (data) or missing byte (!data) of f
+// at or after offset. The end of the file counts as a hole.
+static off_t
+seek_piece(File *f, off_t offset, bool data) {
+	auto ti = handle.torrent_file();
+
+	off_t pos = f->base + offset;
+	off_t end = f->base + f->size;
+
+	libtorrent::peer_request part = ti->map_file(f->index, pos, 0);
 
-static int
-btfs_read(const char *path, char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi) {
-	if (!is_dir(path) && !is_file(path))
-		return -ENOENT;
+	// Start of each piece, in file coordinates
+	off_t start = pos - part.start;
 
-	if (is_dir(path))
-		return -EISDIR;
+	for (int i = part.piece; start < end; i++) {
+		if (handle.have_piece(i) == data)
+			return std::max(start, pos) - f->base;
 
-	if (params.browse_only)
-		return -EACCES;
+		start += ti->piece_size(i);
+	}
 
-	pthread_mutex_lock(&lock);
+	return data ? -ENXIO : f->size;
+}
 
-	Read *r = new Read(buf, files[path], offset, size);
+static off_t
+btfs_lseek(const char *path, off_t offset, int whence,
+		struct fuse_file_info *fi) {
+	// The kernel only asks for these
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return -EINVAL;
 
-	reads.push_back(r);
+	File *f = (File *) fi->fh;
 
-	// Wait for read to finish
-	int s = r->read();
+	if (offset < 0 || offset >= f->size)
+		return -ENXIO;
 
-	reads.remove(r);
+	pthread_mutex_lock(&lock);
 
-	delete r;
+	off_t o = seek_piece(f, offset, whence == SEEK_DATA);
 
 	pthread_mutex_unlock(&lock);
 
-	return s;
+	return o;
 }
+#endif
 
 static int
 btfs_statfs(const char *path, struct statvfs *stbuf) {
@@ -557,7 +2522,11 @@ btfs_statfs(const char *path, struct statvfs *stbuf) {
 	stbuf->f_blocks = (fsblkcnt_t) (ti->total_size() / 512);
 	stbuf->f_bfree = (fsblkcnt_t) ((ti->total_size() - st.total_done) / 512);
 	stbuf->f_bavail = (fsblkcnt_t) ((ti->total_size() - st.total_done) / 512);
+	pthread_mutex_lock(&lock);
+
 	stbuf->f_files = (fsfilcnt_t) (files.size() + dirs.size());
+
+	pthread_mutex_unlock(&lock);
 	stbuf->f_ffree = 0;
 
 	return 0;
@@ -568,6 +2537,14 @@ btfs_init(struct fuse_conn_info *conn,
 		struct fuse_config *cfg) {
 	pthread_mutex_lock(&lock);
 
+#ifdef HAVE_PASSTHROUGH
+	if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+		conn->want |= FUSE_CAP_PASSTHROUGH;
+
+		passthrough = true;
+	}
+#endif
+
 	time_of_mount = time(NULL);
 
 	libtorrent::add_torrent_params *p = (libtorrent::add_torrent_params *)
@@ -578,8 +2555,11 @@ btfs_init(struct fuse_conn_info *conn,
 #else
 	libtorrent::session_flags_t flags =
 #endif
-		libtorrent::session::add_default_plugins |
-		libtorrent::session::start_default_features;
+		libtorrent::session::add_default_plugins;
+
+	// No DHT, local peer discovery or port mapping in cluster mode
+	if (!params.cluster)
+		flags |= libtorrent::session::start_default_features;
 
 #if LIBTORRENT_VERSION_NUM < 10200
 	int alerts =
@@ -593,8 +2573,15 @@ btfs_init(struct fuse_conn_info *conn,
 		libtorrent::alert::status_notification |
 		libtorrent::alert::error_notification |
 		libtorrent::alert::dht_notification |
+#if LIBTORRENT_VERSION_NUM >= 10200
+		libtorrent::alert::file_progress_notification |
+#endif
 		libtorrent::alert::peer_notification;
 
+	if (trace)
+		// Needed to see when the first block of a piece arrives
+		alerts |= libtorrent::alert::block_progress_notification;
+
 #if LIBTORRENT_VERSION_NUM < 10100
 	session = new libtorrent::session(
 		libtorrent::fingerprint(
@@ -620,9 +2607,15 @@ btfs_init(struct fuse_conn_info *conn,
 	se.upload_rate_limit = params.max_upload_rate * 1024;
 
 	session->set_settings(se);
-	session->add_dht_router(std::make_pair("router.bittorrent.com", 6881));
-	session->add_dht_router(std::make_pair("router.utorrent.com", 6881));
-	session->add_dht_router(std::make_pair("dht.transmissionbt.com", 6881));
+
+	if (!params.cluster) {
+		session->add_dht_router(std::make_pair("router.bittorrent.com",
+			6881));
+		session->add_dht_router(std::make_pair("router.utorrent.com",
+			6881));
+		session->add_dht_router(std::make_pair("dht.transmissionbt.com",
+			6881));
+	}
 	session->async_add_torrent(*p);
 #else
 	libtorrent::settings_pack pack;
@@ -659,14 +2652,35 @@ btfs_init(struct fuse_conn_info *conn,
 	pack.set_bool(pack.enable_outgoing_tcp, !params.utp_only);
 	pack.set_int(pack.download_rate_limit, params.max_download_rate * 1024);
 	pack.set_int(pack.upload_rate_limit, params.max_upload_rate * 1024);
+
+	// Steer peers towards pieces that can be uploaded without disk reads
+	if (params.reciprocity)
+		pack.set_int(pack.suggest_mode, pack.suggest_read_cache);
+
+	if (params.cluster) {
+		pack.set_bool(pack.enable_dht, false);
+		pack.set_bool(pack.enable_lsd, false);
+		pack.set_bool(pack.enable_upnp, false);
+		pack.set_bool(pack.enable_natpmp, false);
+	}
 	pack.set_int(pack.alert_mask, alerts);
 
 	session = new libtorrent::session(pack, flags);
 
+#if LIBTORRENT_VERSION_NUM >= 10200
+	if (params.reciprocity)
+		session->add_extension(std::make_shared<Reciprocity>());
+#endif
+
 #if LIBTORRENT_VERSION_NUM < 10101
-	session->add_dht_router(std::make_pair("router.bittorrent.com", 6881));
-	session->add_dht_router(std::make_pair("router.utorrent.com", 6881));
-	session->add_dht_router(std::make_pair("dht.transmissionbt.com", 6881));
+	if (!params.cluster) {
+		session->add_dht_router(std::make_pair("router.bittorrent.com",
+			6881));
+		session->add_dht_router(std::make_pair("router.utorrent.com",
+			6881));
+		session->add_dht_router(std::make_pair("dht.transmissionbt.com",
+			6881));
+	}
 #endif
 
 	session->add_torrent(*p);
@@ -679,6 +2693,10 @@ btfs_init(struct fuse_conn_info *conn,
 	pthread_setname_np(alert_thread, "alert");
 #endif
 
+	// Without io_uring, reads go through libtorrent
+	if (params.io_uring)
+		disk_reader.start();
+
 	pthread_mutex_unlock(&lock);
 
 	return NULL;
@@ -686,11 +2704,39 @@ btfs_init(struct fuse_conn_info *conn,
 
 static void
 btfs_destroy(void *user_data) {
+	// Its callbacks take the lock
+	disk_reader.stop();
+
+	pthread_mutex_lock(&lock);
+
+	store_stop = true;
+
+	bool importing = store_importing;
+
+	pthread_mutex_unlock(&lock);
+
+	pthread_cond_broadcast(&signal_cond);
+
+	// It adds pieces to the torrent, which is removed below
+	if (importing)
+		pthread_join(store_thread, NULL);
+
 	pthread_mutex_lock(&lock);
 
+	for (std::map<int,int>::iterator i = disk_fds.begin();
+			i != disk_fds.end(); ++i) {
+		close(i->second);
+	}
+
+	disk_fds.clear();
+
 	pthread_cancel(alert_thread);
 	pthread_join(alert_thread, NULL);
 
+	// After the alert thread, which saves it too
+	if (!heatmap_path.empty())
+		save_heatmap(first_reads);
+
 #if LIBTORRENT_VERSION_NUM < 10200
 	int flags = 0;
 #else
@@ -704,27 +2750,121 @@ btfs_destroy(void *user_data) {
 
 	delete session;
 
+	delete trace;
+
+	trace = NULL;
+
 	pthread_mutex_unlock(&lock);
 }
 
+// Read-only xattrs of file index describing its content, by name. The
+// piece hashes take a pass over all pieces of the file, so they are left
+// empty unless piece_hashes is set.
+static std::map<std::string,std::string>
+content_xattrs(int index, bool piece_hashes) {
+	auto ti = handle.torrent_file();
+
+	std::map<std::string,std::string> xattrs;
+
+	std::ostringstream info_hash;
+
+#if LIBTORRENT_VERSION_NUM < 20000
+	info_hash << ti->info_hash();
+#else
+	if (ti->info_hashes().has_v1())
+		info_hash << ti->info_hashes().v1;
+	else
+		info_hash << ti->info_hashes().v2;
+
+	if (!ti->files().root(index).is_all_zeros()) {
+		std::ostringstream root;
+
+		root << ti->files().root(index);
+
+		xattrs[XATTR_MERKLE_ROOT] = root.str();
+	}
+#endif
+
+	xattrs[XATTR_INFO_HASH] = info_hash.str();
+	xattrs[XATTR_PIECE_SIZE] = std::to_string(ti->piece_length());
+
+#if LIBTORRENT_VERSION_NUM < 10100
+	int64_t file_size = ti->file_at(index).size;
+#else
+	int64_t file_size = ti->files().file_size(index);
+#endif
+
+#if LIBTORRENT_VERSION_NUM >= 20000
+	// v2-only torrents have no SHA-1 piece hashes
+	bool v1 = ti->v1();
+#else
+	bool v1 = true;
+#endif
+
+	std::ostringstream hashes;
+
+	// Pieces are only had once they have passed their hash check
+	bool verified = true;
+
+	if (file_size > 0) {
+		int first = ti->map_file(index, 0, 0).piece;
+		int last = ti->map_file(index, file_size - 1, 0).piece;
+
+		for (int i = first; i <= last && verified; i++)
+			verified = handle.have_piece(i);
+
+		for (int i = first; i <= last && v1 && piece_hashes; i++)
+			hashes << ti->hash_for_piece(i);
+
+		xattrs[XATTR_PIECES] = std::to_string(first) + "-" +
+			std::to_string(last);
+	} else {
+		xattrs[XATTR_PIECES] = "";
+	}
+
+	if (v1)
+		xattrs[XATTR_PIECE_HASHES] = hashes.str();
+
+	xattrs[XATTR_VERIFIED] = verified ? "1" : "0";
+
+#if LIBTORRENT_VERSION_NUM >= 20000
+	// Older versions may not have written out finished pieces yet
+	xattrs[XATTR_BACKING_PATH] = disk_path(index);
+#endif
+
+	return xattrs;
+}
+
 static int
 btfs_listxattr(const char *path, char *data, size_t len) {
-	const char *xattrs = NULL;
-	int xattrslen = 0;
+	std::string xattrs;
 
 	if (is_root(path)) {
-		xattrs = XATTR_IS_BTFS "\0" XATTR_IS_BTFS_ROOT;
-		xattrslen = sizeof (XATTR_IS_BTFS "\0" XATTR_IS_BTFS_ROOT);
+		xattrs = std::string(XATTR_IS_BTFS "\0" XATTR_IS_BTFS_ROOT,
+			sizeof (XATTR_IS_BTFS "\0" XATTR_IS_BTFS_ROOT));
 	} else if (is_dir(path)) {
-		xattrs = XATTR_IS_BTFS;
-		xattrslen = sizeof (XATTR_IS_BTFS);
+		xattrs = std::string(XATTR_IS_BTFS, sizeof (XATTR_IS_BTFS));
 	} else if (is_file(path)) {
-		xattrs = XATTR_IS_BTFS "\0" XATTR_FILE_INDEX;
-		xattrslen = sizeof (XATTR_IS_BTFS "\0" XATTR_FILE_INDEX);
+		xattrs = std::string(XATTR_IS_BTFS "\0" XATTR_FILE_INDEX,
+			sizeof (XATTR_IS_BTFS "\0" XATTR_FILE_INDEX));
+
+		pthread_mutex_lock(&lock);
+
+		std::map<std::string,std::string> content =
+			content_xattrs(files[path], false);
+
+		pthread_mutex_unlock(&lock);
+
+		for (auto i = content.begin(); i != content.end(); ++i)
+			xattrs += i->first + '\0';
+	} else if (is_member(path)) {
+		xattrs = std::string(XATTR_IS_BTFS, sizeof (XATTR_IS_BTFS));
 	} else {
 		return -ENOENT;
 	}
 
+	int xattrslen = (int) xattrs.size();
+
 	// The minimum required length
 	if (len == 0)
 		return xattrslen;
@@ -732,7 +2872,7 @@ btfs_listxattr(const char *path, char *data, size_t len) {
 	if (len < (size_t) xattrslen)
 		return -ERANGE;
 
-	memcpy(data, xattrs, (size_t) xattrslen);
+	memcpy(data, xattrs.data(), (size_t) xattrslen);
 
 	return xattrslen;
 }
@@ -740,21 +2880,46 @@ btfs_listxattr(const char *path, char *data, size_t len) {
 static int
 btfs_getxattr(const char *path, const char *key, char *value, size_t len) {
 	uint32_t position = 0;
-	char xattr[16];
-	int xattrlen = 0;
+	std::string xattr;
 
 	std::string k(key);
 
 	if (is_file(path) && k == XATTR_FILE_INDEX) {
-		xattrlen = snprintf(xattr, sizeof (xattr), "%d", files[path]);
+		xattr = std::to_string(files[path]);
 	} else if (is_root(path) && k == XATTR_IS_BTFS_ROOT) {
-		xattrlen = 0;
+		xattr = "";
 	} else if (k == XATTR_IS_BTFS) {
-		xattrlen = 0;
+		xattr = "";
+	} else if (k == XATTR_CLASS) {
+		pthread_mutex_lock(&lock);
+
+		xattr = is_background() ? "background" : "foreground";
+
+		pthread_mutex_unlock(&lock);
+	} else if (is_file(path)) {
+		pthread_mutex_lock(&lock);
+
+		std::map<std::string,std::string> content =
+			content_xattrs(files[path], k == XATTR_PIECE_HASHES);
+
+		pthread_mutex_unlock(&lock);
+
+		auto i = content.find(k);
+
+		if (i == content.end())
+			return -ENODATA;
+
+		xattr = i->second;
+
+		// Too many pieces, use the info-hash and piece range instead
+		if (xattr.size() > XATTR_SIZE_MAX)
+			return -E2BIG;
 	} else {
 		return -ENODATA;
 	}
 
+	int xattrlen = (int) xattr.size();
+
 	// The minimum required length
 	if (len == 0)
 		return xattrlen;
@@ -765,13 +2930,107 @@ btfs_getxattr(const char *path, const char *key, char *value, size_t len) {
 	if (len < (size_t) xattrlen - position)
 		return -ERANGE;
 
-	memcpy(value, xattr + position, (size_t) xattrlen - position);
+	memcpy(value, xattr.data() + position, (size_t) xattrlen - position);
 
 	return xattrlen - (int) position;
 }
 
+static void
+prefetch(int index, int64_t offset, int64_t length, int priority) {
+	auto ti = handle.torrent_file();
+
+#if LIBTORRENT_VERSION_NUM < 10100
+	int64_t file_size = ti->file_at(index).size;
+#else
+	int64_t file_size = ti->files().file_size(index);
+#endif
+
+	if (offset >= file_size)
+		return;
+
+	// Zero length means the rest of the file
+	if (length <= 0 || length > file_size - offset)
+		length = file_size - offset;
+
+	int first = ti->map_file(index, offset, 0).piece;
+	int last = ti->map_file(index, offset + length - 1, 1).piece;
+
+	for (int i = first; i <= last; i++) {
+		// Never lower the priority of the sliding window
+		if (!handle.have_piece(i) &&
+				torrent_pieces.piece_priority(i) < priority)
+			torrent_pieces.piece_priority(i, priority);
+	}
+}
+
+static int
+set_class(const std::string& c) {
+	if (c != "foreground" && c != "background")
+		return -EINVAL;
+
+	pthread_mutex_lock(&lock);
+
+	prune_background_pids();
+
+	// Tags the calling process
+	background_pids[fuse_get_context()->pid] = c == "background";
+
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+static int
+btfs_setxattr(const char *path, const char *key, const char *value,
+		size_t len, int flags) {
+	std::string k(key);
+
+	if (k == XATTR_CLASS)
+		return set_class(std::string(value, len));
+
+	if (!is_file(path) || k != XATTR_PREFETCH)
+		return -ENOTSUP;
+
+	if (params.browse_only)
+		return -EACCES;
+
+	std::string v(value, len);
+
+	std::replace(v.begin(), v.end(), ',', ' ');
+
+	std::istringstream ranges(v);
+
+	std::vector<std::tuple<int64_t, int64_t, int> > parsed;
+
+	for (std::string r; ranges >> r;) {
+		int64_t offset = 0, length = 0;
+		int priority = PREFETCH_PRIORITY;
+
+		int n = sscanf(r.c_str(), "%" SCNd64 ":%" SCNd64 ":%d", &offset,
+			&length, &priority);
+
+		if (n < 2 || offset < 0 || length < 0 || priority < 1 ||
+				priority > PREFETCH_PRIORITY_MAX)
+			return -EINVAL;
+
+		parsed.push_back(std::make_tuple(offset, length, priority));
+	}
+
+	pthread_mutex_lock(&lock);
+
+	for (size_t i = 0; i < parsed.size(); i++) {
+		prefetch(files[path], std::get<0>(parsed[i]),
+			std::get<1>(parsed[i]), std::get<2>(parsed[i]));
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
 static bool
-populate_target(std::string& target, char *arg, const std::string& name) {
+populate_target(std::string& target, const char *arg,
+		const std::string& name) {
 	std::string templ;
 
 	if (arg) {
@@ -819,6 +3078,13 @@ populate_target(std::string& target, char *arg, const std::string& name) {
 	return target.length() > 0;
 }
 
+static int
+remove_dir(const char *path, const struct stat *st, int flag,
+		struct FTW *ftw) {
+	// Only remove directories, never data
+	return flag == FTW_DP ? rmdir(path) : 0;
+}
+
 static size_t
 handle_http(void *contents, size_t size, size_t nmemb, void *userp) {
 	Array *output = (Array *) userp;
@@ -927,6 +3193,14 @@ populate_metadata(libtorrent::add_torrent_params& p, const char *arg) {
 
 #define BTFS_OPT(t, p, v) { t, offsetof(struct btfs_params, p), v }
 
+enum {
+	KEY_WEB_SEED,
+	KEY_DATA_DIRECTORY,
+	KEY_PEER,
+	KEY_INCLUDE,
+	KEY_EXCLUDE,
+};
+
 static const struct fuse_opt btfs_opts[] = {
 	BTFS_OPT("-v",                           version,              1),
 	BTFS_OPT("--version",                    version,              1),
@@ -940,11 +3214,33 @@ static const struct fuse_opt btfs_opts[] = {
 	BTFS_OPT("-s",                           silent,               1),
 	BTFS_OPT("--silent",                     silent,               1),
 	BTFS_OPT("--utp-only",                   utp_only,             1),
-	BTFS_OPT("--data-directory=%s",          data_directory,       4),
+	BTFS_OPT("--dedup",                      dedup,                1),
+	BTFS_OPT("--archives",                   archives,             1),
+	BTFS_OPT("--cache-size=%u",              cache_size,           4),
+	FUSE_OPT_KEY("--data-directory=",        KEY_DATA_DIRECTORY),
+	BTFS_OPT("--placement=%s",               placement,            4),
+	BTFS_OPT("--deadline=%u",                deadline,             4),
+	BTFS_OPT("--background-window=%u",       background_window,    4),
+	BTFS_OPT("--background-uid=%u",          background_uid,       4),
 	BTFS_OPT("--min-port=%lu",               min_port,             4),
 	BTFS_OPT("--max-port=%lu",               max_port,             4),
 	BTFS_OPT("--max-download-rate=%lu",      max_download_rate,    4),
 	BTFS_OPT("--max-upload-rate=%lu",        max_upload_rate,      4),
+	BTFS_OPT("--web-seed-delay=%u",          web_seed_delay,       4),
+	BTFS_OPT("--short-reads",                short_reads,          1),
+	BTFS_OPT("--max-read-wait=%u",           max_read_wait,        4),
+	BTFS_OPT("--trace=%s",                   trace,                4),
+	BTFS_OPT("--access-log=%s",              access_log,           4),
+	FUSE_OPT_KEY("--web-seed=",              KEY_WEB_SEED),
+	FUSE_OPT_KEY("--peer=",                  KEY_PEER),
+	FUSE_OPT_KEY("--include=",               KEY_INCLUDE),
+	FUSE_OPT_KEY("--exclude=",               KEY_EXCLUDE),
+	BTFS_OPT("--cluster",                    cluster,              1),
+	BTFS_OPT("--ready-fd=%u",                ready_fd,             4),
+	BTFS_OPT("--metadata-wait=%u",           metadata_wait,        4),
+	BTFS_OPT("--io-uring",                   io_uring,             1),
+	BTFS_OPT("--heatmap",                    heatmap,              1),
+	BTFS_OPT("--reciprocity",                reciprocity,          1),
 	FUSE_OPT_END
 };
 
@@ -963,9 +3259,90 @@ btfs_process_arg(void *data, const char *arg, int key,
 		return n <= 1 ? 0 : 1;
 	}
 
+	if (key == KEY_WEB_SEED) {
+		web_seed_args.push_back(arg + strlen("--web-seed="));
+
+		return 0;
+	}
+
+	if (key == KEY_DATA_DIRECTORY) {
+		data_directory_args.push_back(arg + strlen("--data-directory="));
+
+		return 0;
+	}
+
+	if (key == KEY_PEER) {
+		peer_args.push_back(arg + strlen("--peer="));
+
+		return 0;
+	}
+
+	if (key == KEY_INCLUDE) {
+		include_args.push_back(arg + strlen("--include="));
+
+		return 0;
+	}
+
+	if (key == KEY_EXCLUDE) {
+		exclude_args.push_back(arg + strlen("--exclude="));
+
+		return 0;
+	}
+
 	return 1;
 }
 
+static bool
+resolve_peer(const std::string& arg, libtorrent::tcp::endpoint& endpoint) {
+	std::string::size_type colon = arg.rfind(':');
+
+	if (colon == std::string::npos || colon == 0)
+		return false;
+
+	std::string host = arg.substr(0, colon);
+	std::string port = arg.substr(colon + 1);
+
+	// IPv6 addresses are given as [address]:port
+	if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+		host = host.substr(1, host.size() - 2);
+
+	struct addrinfo hints, *res = NULL;
+
+	memset(&hints, 0, sizeof (hints));
+
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+		return false;
+
+	char ip[NI_MAXHOST];
+
+	int r = getnameinfo(res->ai_addr, res->ai_addrlen, ip, sizeof (ip),
+		NULL, 0, NI_NUMERICHOST);
+
+	freeaddrinfo(res);
+
+	if (r != 0)
+		return false;
+
+	libtorrent::error_code ec;
+
+#if LIBTORRENT_VERSION_NUM < 10200
+	libtorrent::address address = libtorrent::address::from_string(ip, ec);
+#else
+	libtorrent::address address = libtorrent::make_address(ip, ec);
+#endif
+
+	if (ec)
+		return false;
+
+	endpoint = libtorrent::tcp::endpoint(address,
+		(unsigned short) atoi(port.c_str()));
+
+	return true;
+}
+
 static void
 print_help() {
 	printf("usage: " PACKAGE " [options] metadata mountpoint\n");
@@ -978,11 +3355,33 @@ print_help() {
 	printf("    --keep -k              keep files after unmount\n");
 	printf("    --silent -s            do not create logs\n");
 	printf("    --utp-only             do not use TCP\n");
+	printf("    --dedup                share identical files between torrents\n");
+	printf("    --archives             show zip and tar members as files\n");
+	printf("    --cache-size=N         MiB of pieces to keep in memory ahead of readers\n");
 	printf("    --data-directory=dir   directory in which to put btfs data\n");
+	printf("    --placement=policy     round-robin or free-space\n");
 	printf("    --min-port=N           start of listen port range\n");
 	printf("    --max-port=N           end of listen port range\n");
 	printf("    --max-download-rate=N  max download rate (in kB/s)\n");
 	printf("    --max-upload-rate=N    max upload rate (in kB/s)\n");
+	printf("    --web-seed=URL         HTTP mirror to use (repeatable)\n");
+	printf("    --peer=HOST:PORT       peer to connect to (repeatable)\n");
+	printf("    --include=GLOB         only mount matching files (repeatable)\n");
+	printf("    --exclude=GLOB         do not mount matching files (repeatable)\n");
+	printf("    --cluster              only use the peers given with --peer\n");
+	printf("    --ready-fd=N           write to fd N once metadata is loaded\n");
+	printf("    --metadata-wait=N      ms lookups wait for metadata\n");
+	printf("    --io-uring             read finished pieces from disk with io_uring\n");
+	printf("    --heatmap              fetch pieces earlier mounts read first\n");
+	printf("    --reciprocity          upload to peers with pieces readers wait for\n");
+	printf("    --web-seed-delay=N     ms before a blocked read uses mirrors\n");
+	printf("    --short-reads          return downloaded data without waiting\n");
+	printf("    --max-read-wait=N      ms a read may block before returning\n");
+	printf("    --trace=file           write piece events to file\n");
+	printf("    --access-log=file      write reads to file, for btfssim\n");
+	printf("    --deadline=N           ms deadline for foreground window pieces\n");
+	printf("    --background-window=N  pieces in the background window\n");
+	printf("    --background-uid=N     treat readers with this uid as background\n");
 }
 
 int
@@ -991,17 +3390,31 @@ main(int argc, char *argv[]) {
 	memset(&btfs_ops, 0, sizeof (btfs_ops));
 
 	btfs_ops.getattr = btfs_getattr;
+	btfs_ops.opendir = btfs_opendir;
 	btfs_ops.readdir = btfs_readdir;
+	btfs_ops.releasedir = btfs_releasedir;
 	btfs_ops.open = btfs_open;
 	btfs_ops.read = btfs_read;
+	btfs_ops.release = btfs_release;
+	btfs_ops.poll = btfs_poll;
+	btfs_ops.ioctl = btfs_ioctl;
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+	btfs_ops.lseek = btfs_lseek;
+#endif
 	btfs_ops.statfs = btfs_statfs;
 	btfs_ops.listxattr = btfs_listxattr;
 	btfs_ops.getxattr = btfs_getxattr;
+	btfs_ops.setxattr = btfs_setxattr;
 	btfs_ops.init = btfs_init;
 	btfs_ops.destroy = btfs_destroy;
 
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
+	// No uid is background unless asked for
+	params.background_uid = -1;
+	params.ready_fd = -1;
+	params.web_seed_delay = -1;
+
 	if (fuse_opt_parse(&args, &params, btfs_opts, btfs_process_arg))
 		RETV(fprintf(stderr, "Failed to parse options\n"), -1);
 
@@ -1047,6 +3460,50 @@ main(int argc, char *argv[]) {
 	if (params.min_port > params.max_port)
 		RETV(fprintf(stderr, "Invalid port range\n"), -1);
 
+	if (params.placement && strcmp(params.placement, "round-robin") != 0 &&
+			strcmp(params.placement, "free-space") != 0)
+		RETV(fprintf(stderr, "Invalid placement policy '%s'\n",
+			params.placement), -1);
+
+	for (size_t i = 0; i < peer_args.size(); i++) {
+		libtorrent::tcp::endpoint endpoint;
+
+		if (!resolve_peer(peer_args[i], endpoint))
+			RETV(fprintf(stderr, "Invalid peer '%s'\n",
+				peer_args[i].c_str()), -1);
+
+		static_peers.push_back(endpoint);
+	}
+
+	if (params.cluster && static_peers.empty())
+		RETV(fprintf(stderr, "Cluster mode needs at least one peer\n"),
+			-1);
+
+	if (params.web_seed_delay < 0)
+		params.web_seed_delay = 2000;
+
+	torrent_pieces.short_reads = params.short_reads;
+	torrent_pieces.max_read_wait = params.max_read_wait;
+	torrent_pieces.mirror_delay = params.web_seed_delay;
+
+	if (params.background_window == 0)
+		params.background_window = BACKGROUND_WINDOW_SIZE;
+
+	window = Window(&torrent_pieces, WINDOW_SIZE, WINDOW_PRIORITY,
+		params.deadline);
+	background = Window(&torrent_pieces, params.background_window,
+		BACKGROUND_PRIORITY);
+
+	if (params.trace)
+		trace = new Trace(params.trace);
+
+	if (params.access_log) {
+		access_log.open(params.access_log);
+
+		if (!access_log.is_open())
+			RETV(perror("Failed to open access log"), -1);
+	}
+
 	libtorrent::add_torrent_params p;
 
 #if LIBTORRENT_VERSION_NUM < 10200
@@ -1062,20 +3519,93 @@ main(int argc, char *argv[]) {
 	if (!populate_metadata(p, params.metadata))
 		return -1;
 
+	for (size_t i = 0; i < web_seed_args.size(); i++)
+		p.url_seeds.push_back(web_seed_args[i]);
+
+	p.peers = static_peers;
+
+#if LIBTORRENT_VERSION_NUM >= 10200
+	if (p.ti) {
+		// Don't start on files left out before setup() gets to run
+		for (int i = 0; i < p.ti->num_files(); i++) {
+			p.file_priorities.push_back(
+				is_selected(p.ti->files().file_path(i)) ?
+				libtorrent::default_priority :
+				libtorrent::dont_download);
+		}
+	}
+#endif
+
+	if (params.cluster)
+		p.trackers.clear();
+
 	std::ostringstream hash_stream;
 	auto info_hashes = p.ti ? p.ti->info_hashes() : p.info_hashes;
 	hash_stream << info_hashes.get_best();
 
-	std::string target;
+	// Without any data directory, use the default one
+	if (data_directory_args.empty())
+		data_directory_args.push_back(std::string());
 
-	if (!populate_target(target, params.data_directory, hash_stream.str()))
-		return -1;
+	std::vector<std::string> targets;
 
-	p.save_path = target + "/files";
+	for (size_t i = 0; i < data_directory_args.size(); i++) {
+		std::string target;
 
-	if (mkdir(p.save_path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0) {
-		if (errno != EEXIST)
-			RETV(perror("Failed to create files directory"), -1);
+		if (!populate_target(target, data_directory_args[i].empty() ?
+				NULL : data_directory_args[i].c_str(),
+				hash_stream.str()))
+			return -1;
+
+		std::string files = target + "/files";
+
+		if (mkdir(files.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0) {
+			if (errno != EEXIST)
+				RETV(perror("Failed to create files directory"), -1);
+		}
+
+		targets.push_back(target);
+		save_paths.push_back(files);
+	}
+
+	std::string target = targets[0];
+
+	p.save_path = save_paths[0];
+
+	if (params.dedup) {
+		// The store is next to the per-torrent directories
+		store_path = target.substr(0, target.rfind('/')) + "/store";
+
+		if (mkdir(store_path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0) {
+			if (errno != EEXIST)
+				RETV(perror("Failed to create store directory"), -1);
+		}
+	}
+
+#if LIBTORRENT_VERSION_NUM >= 10200
+	if (p.ti) {
+		std::map<int,std::string> renamed = place_files(p.ti.get());
+
+		for (auto i = renamed.begin(); i != renamed.end(); ++i)
+			p.renamed_files[i->first] = i->second;
+
+		// libtorrent checks them when adding the torrent, like any files
+		// already in place
+		if (!store_path.empty())
+			link_from_store(p.ti.get());
+	}
+#endif
+
+	if (params.heatmap) {
+		// Heatmaps outlive the per-torrent directories
+		std::string dir = target.substr(0, target.rfind('/')) + "/heatmaps";
+
+		if (mkdir(dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0) {
+			if (errno != EEXIST)
+				RETV(perror("Failed to create heatmap directory"), -1);
+		}
+
+		heatmap_path = dir + "/" + hash_stream.str();
 	}
 
 	fuse_main(args.argc, args.argv, &btfs_ops, (void *) &p);
@@ -1088,6 +3618,13 @@ main(int argc, char *argv[]) {
 
 		if (rmdir(target.c_str()))
 			RETV(perror("Failed to remove target directory"), -1);
+
+		// libtorrent leaves the directories of moved files behind
+		for (size_t i = 1; i < targets.size(); i++) {
+			if (nftw(targets[i].c_str(), remove_dir, 16,
+					FTW_DEPTH | FTW_PHYS))
+				RETV(perror("Failed to remove target directory"), -1);
+		}
 	}
 
 	return 0;
@@ -22,60 +22,154 @@ along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <vector>
 #include <list>
+#include <map>
+#include <memory>
+#include <set>
 #include <fstream>
 
+#include <pthread.h>
+
 #include "libtorrent/config.hpp"
-#include <libtorrent/peer_request.hpp>
+#include <libtorrent/version.hpp>
+
+#if LIBTORRENT_VERSION_NUM >= 10200
+#include <libtorrent/extensions.hpp>
+#include <libtorrent/peer_connection_handle.hpp>
+#endif
 
 #include "btfsstat.h"
+#include "btfstrace.h"
+#include "window.h"
+#include "read.h"
+#include "archive.h"
+#include "choke.h"
+
+struct fuse_pollhandle;
 
 namespace btfs
 {
 
-class Part;
-class Read;
+class File;
 
-typedef std::vector<Part>::iterator parts_iter;
-typedef std::list<Read*>::iterator reads_iter;
+typedef std::list<File*>::iterator opens_iter;
 
-class Part
+class File
 {
-	friend class Read;
-
 public:
-	Part(libtorrent::peer_request p, char *b) : part(p), buf(b),
-			filled(false) {
+	File(int i, int64_t s, off_t b = 0) : index(i), size(s), base(b) {
 	}
 
-private:
-	libtorrent::peer_request part;
+	int index;
 
-	char *buf;
+	// Size of the file, or of the archive member
+	int64_t size;
 
-	bool filled;
+	// Offset of an archive member's data in the file, 0 otherwise
+	off_t base;
+
+	// Kernel passthrough backing file, if any
+	int backing_id = 0;
+
+	// Offset following the last read, where a sequential reader continues
+	off_t position = 0;
+
+	// Pending poll(), notified once data at position is downloaded
+	struct fuse_pollhandle *ph = NULL;
 };
 
-class Read
+class TorrentPieces : public ReadSource
 {
 public:
-	Read(char *buf, int index, off_t offset, size_t size);
+	TorrentPieces(pthread_mutex_t *l, pthread_cond_t *c) :
+			ReadSource(l, c) {
+	}
+
+	int num_pieces();
+
+	bool have_piece(int piece);
+
+	// Priority given to piece by btfs, 0 if none
+	int piece_priority(int piece);
 
-	void fail(int piece);
+	void piece_priority(int piece, int priority);
 
-	void copy(int piece, char *buffer, int size);
+	void piece_deadline(int piece, int ms);
 
-	void trigger();
+	void entered_window(int piece);
 
-	bool finished();
+	void left_window(int piece, int priority);
 
-	int size();
+	int piece_size(int piece);
 
-	int read();
+	int64_t file_size(int index);
+
+	void map_file(int index, int64_t offset, int& piece, int& start);
+
+	void read_piece(int piece);
+
+	bool read_direct(Read *r, size_t part, int index, off_t offset,
+		int length);
+
+	bool has_mirrors();
+
+	void fetch(const std::vector<int>& pieces);
+
+	void event(trace_type type, int piece, int64_t value = 0);
 
 private:
-	bool failed = false;
+	// Priorities set through piece_priority(), so that reads need not
+	// ask libtorrent for them. Protected by the global lock.
+	std::map<int,int> priorities;
+};
 
-	std::vector<Part> parts;
+#if LIBTORRENT_VERSION_NUM >= 10200
+class ReciprocityPeer : public libtorrent::peer_plugin
+{
+public:
+	ReciprocityPeer(libtorrent::peer_connection_handle const& p) :
+			peer(p) {
+	}
+
+	// Number of the given pieces the peer has
+	int score(const std::set<int>& pieces);
+
+	libtorrent::peer_connection_handle peer;
+};
+
+class ReciprocityTorrent : public libtorrent::torrent_plugin
+{
+public:
+	std::shared_ptr<libtorrent::peer_plugin> new_connection(
+		libtorrent::peer_connection_handle const& p);
+
+	// Called every second, hands out upload slots
+	void tick();
+
+private:
+	std::list<std::weak_ptr<ReciprocityPeer>> peers;
+};
+
+// Gives upload slots to peers that have the pieces readers are waiting
+// for, so that they return the favor
+class Reciprocity : public libtorrent::plugin
+{
+public:
+#if LIBTORRENT_VERSION_NUM < 20000
+	std::shared_ptr<libtorrent::torrent_plugin> new_torrent(
+		libtorrent::torrent_handle const& h, void *userdata);
+#else
+	std::shared_ptr<libtorrent::torrent_plugin> new_torrent(
+		libtorrent::torrent_handle const& h,
+		libtorrent::client_data_t userdata);
+#endif
+};
+#endif
+
+struct Member {
+	// Index of the archive file
+	int index;
+
+	archive_entry entry;
 };
 
 class Array
@@ -117,6 +211,26 @@ private:
 	std::string path;
 };
 
+class Trace
+{
+public:
+	Trace(std::string p);
+
+	~Trace();
+
+	void event(trace_type type, int piece, int64_t value = 0);
+
+	// Log TRACE_FIRST_BLOCK, but only once per piece
+	void block(int piece);
+
+private:
+	FILE *file;
+
+	std::set<int> started;
+
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+};
+
 struct btfs_params {
 	int version;
 	int help;
@@ -125,11 +239,28 @@ struct btfs_params {
 	int keep;
 	int silent;
 	int utp_only;
-	char *data_directory;
+	int dedup;
 	int min_port;
 	int max_port;
 	int max_download_rate;
 	int max_upload_rate;
+	int web_seed_delay;
+	int short_reads;
+	int max_read_wait;
+	char *trace;
+	char *access_log;
+	char *placement;
+	int deadline;
+	int background_window;
+	int background_uid;
+	int archives;
+	int cache_size;
+	int cluster;
+	int ready_fd;
+	int metadata_wait;
+	int io_uring;
+	int heatmap;
+	int reciprocity;
 	const char *metadata;
 };
 
@@ -0,0 +1,559 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <vector>
+#include <deque>
+#include <set>
+#include <random>
+#include <algorithm>
+
+#include "read.h"
+
+// Milliseconds after the end of a run by which all reads must be done
+#define STUCK_TIME 10000
+
+using namespace btfs;
+
+static struct {
+	int readers = 256;
+	int pieces = 1024;
+	int piece_size = 1024;
+	int read_size = 128;
+	int latency = 100;
+	int disk_threads = 4;
+	int failures = 0;
+	int have = 100;
+	int piece_time = 1000;
+	int duration = 1000;
+	int min_rate = 0;
+	int max_p99 = 0;
+	unsigned int seed = 1;
+} opts;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t signal_cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t
+now_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+// Contents of the fake torrent, so that readers can check what they get
+static char
+byte_at(int piece, int offset) {
+	return (char) (piece * 131 + offset);
+}
+
+// A torrent of one file, with pieces read by a pool of disk threads after
+// some latency and downloaded one by one in priority order, like
+// libtorrent does with the alerts btfs handles
+class FakePieces : public ReadSource
+{
+public:
+	FakePieces(std::mt19937& rng) : ReadSource(&::lock, &::signal_cond),
+			have((size_t) opts.pieces, false),
+			priority((size_t) opts.pieces, 4) {
+		std::uniform_int_distribution<int> percent(0, 99);
+
+		for (size_t i = 0; i < have.size(); i++) {
+			have[i] = percent(rng) < opts.have;
+
+			if (!have[i])
+				wanted.insert(std::make_pair(-4, (int) i));
+		}
+	}
+
+	int num_pieces() {
+		return opts.pieces;
+	}
+
+	bool have_piece(int piece) {
+		return have[(size_t) piece];
+	}
+
+	int piece_priority(int piece) {
+		return priority[(size_t) piece];
+	}
+
+	void piece_priority(int piece, int p) {
+		if (!have[(size_t) piece]) {
+			wanted.erase(std::make_pair(-priority[(size_t) piece],
+				piece));
+			wanted.insert(std::make_pair(-p, piece));
+		}
+
+		priority[(size_t) piece] = p;
+	}
+
+	// Mark the next piece to download as had, -1 if there is none
+	int download() {
+		if (wanted.empty())
+			return -1;
+
+		int piece = wanted.begin()->second;
+
+		wanted.erase(wanted.begin());
+
+		have[(size_t) piece] = true;
+
+		return piece;
+	}
+
+	int piece_size(int piece) {
+		return opts.piece_size << 10;
+	}
+
+	int64_t file_size(int index) {
+		return (int64_t) opts.pieces * (opts.piece_size << 10);
+	}
+
+	void map_file(int index, int64_t offset, int& piece, int& start) {
+		piece = (int) (offset / (opts.piece_size << 10));
+		start = (int) (offset % (opts.piece_size << 10));
+	}
+
+	void read_piece(int piece) {
+		pthread_mutex_lock(&disk_lock);
+
+		queue.push_back(piece);
+
+		issued++;
+
+		pthread_mutex_unlock(&disk_lock);
+
+		pthread_cond_signal(&disk_cond);
+	}
+
+	std::vector<bool> have;
+
+	std::vector<int> priority;
+
+	// Missing pieces, highest priority first, then in order
+	std::set<std::pair<int,int>> wanted;
+
+	// Pieces asked for and not yet read by a disk thread
+	std::deque<int> queue;
+
+	pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t disk_cond = PTHREAD_COND_INITIALIZER;
+
+	int64_t issued = 0;
+
+	bool stop = false;
+};
+
+struct bench {
+	FakePieces *pieces;
+
+	Window *window;
+
+	// Time at which readers stop issuing reads
+	uint64_t end;
+
+	// Number of readers that have stopped
+	int done = 0;
+
+	std::mt19937 failure_rng;
+};
+
+struct reader {
+	bench *b;
+
+	unsigned int seed;
+
+	std::vector<uint64_t> latencies;
+
+	int64_t bytes = 0;
+	int64_t errors = 0;
+	int64_t corrupt = 0;
+};
+
+static void *
+disk_thread(void *data) {
+	bench *b = (bench *) data;
+	FakePieces *p = b->pieces;
+
+	int size = opts.piece_size << 10;
+
+	// Every piece is a slice of this, see byte_at()
+	std::vector<char> pattern((size_t) size + 256);
+
+	for (size_t i = 0; i < pattern.size(); i++)
+		pattern[i] = (char) i;
+
+	while (1) {
+		pthread_mutex_lock(&p->disk_lock);
+
+		while (p->queue.empty() && !p->stop)
+			pthread_cond_wait(&p->disk_cond, &p->disk_lock);
+
+		if (p->queue.empty()) {
+			pthread_mutex_unlock(&p->disk_lock);
+			break;
+		}
+
+		int piece = p->queue.front();
+
+		p->queue.pop_front();
+
+		bool failed = (int) (b->failure_rng() % 100) < opts.failures;
+
+		pthread_mutex_unlock(&p->disk_lock);
+
+		if (opts.latency > 0)
+			usleep((useconds_t) opts.latency);
+
+		const char *data = &pattern[(size_t) (piece * 131 % 256)];
+
+		pthread_mutex_lock(&lock);
+
+		p->piece_read(piece, data, size, failed);
+
+		pthread_mutex_unlock(&lock);
+
+		pthread_cond_broadcast(&signal_cond);
+	}
+
+	return NULL;
+}
+
+static void *
+swarm_thread(void *data) {
+	bench *b = (bench *) data;
+	FakePieces *p = b->pieces;
+
+	while (1) {
+		// Once the run is over, the rest arrives at once, so that readers
+		// still waiting for pieces don't stretch it
+		if (opts.piece_time > 0 && now_us() < b->end)
+			usleep((useconds_t) opts.piece_time);
+
+		pthread_mutex_lock(&lock);
+
+		int next = p->stop ? -1 : p->download();
+
+		if (next < 0) {
+			pthread_mutex_unlock(&lock);
+			break;
+		}
+
+		p->piece_finished(next);
+
+		b->window->advance();
+
+		pthread_mutex_unlock(&lock);
+
+		pthread_cond_broadcast(&signal_cond);
+	}
+
+	return NULL;
+}
+
+static void *
+reader_thread(void *data) {
+	reader *r = (reader *) data;
+	bench *b = r->b;
+
+	std::mt19937 rng(r->seed);
+
+	int64_t size = (int64_t) opts.read_size << 10;
+	int64_t reads = b->pieces->file_size(0) / size;
+
+	std::uniform_int_distribution<int64_t> any(0, reads - 1);
+
+	std::vector<char> buf((size_t) size);
+
+	while (now_us() < b->end) {
+		int64_t offset = any(rng) * size;
+
+		uint64_t start = now_us();
+
+		pthread_mutex_lock(&lock);
+
+		int s = b->pieces->read(buf.data(), 0, (off_t) offset,
+			(size_t) size, *b->window, false);
+
+		pthread_mutex_unlock(&lock);
+
+		r->latencies.push_back(now_us() - start);
+
+		if (s < 0) {
+			r->errors++;
+			continue;
+		}
+
+		int piece_size = opts.piece_size << 10;
+
+		for (int i = 0; i < s; i++) {
+			int64_t o = offset + i;
+
+			if (buf[(size_t) i] != byte_at((int) (o / piece_size),
+					(int) (o % piece_size))) {
+				r->corrupt++;
+				break;
+			}
+		}
+
+		r->bytes += s;
+	}
+
+	pthread_mutex_lock(&lock);
+
+	b->done++;
+
+	pthread_mutex_unlock(&lock);
+
+	pthread_cond_broadcast(&signal_cond);
+
+	return NULL;
+}
+
+static uint64_t
+percentile(const std::vector<uint64_t>& sorted, int p) {
+	if (sorted.empty())
+		return 0;
+
+	return sorted[(sorted.size() - 1) * (size_t) p / 100];
+}
+
+static bool
+run(int readers) {
+	std::mt19937 rng(opts.seed);
+
+	FakePieces pieces(rng);
+	Window window(&pieces);
+
+	bench b;
+
+	b.pieces = &pieces;
+	b.window = &window;
+	b.end = now_us() + (uint64_t) opts.duration * 1000;
+	b.failure_rng.seed(opts.seed);
+
+	std::vector<pthread_t> disks((size_t) opts.disk_threads);
+	std::vector<pthread_t> threads((size_t) readers);
+	std::vector<reader> rs((size_t) readers);
+
+	pthread_t swarm;
+
+	for (size_t i = 0; i < disks.size(); i++)
+		pthread_create(&disks[i], NULL, disk_thread, &b);
+
+	pthread_create(&swarm, NULL, swarm_thread, &b);
+
+	uint64_t start = now_us();
+
+	for (size_t i = 0; i < rs.size(); i++) {
+		rs[i].b = &b;
+		rs[i].seed = opts.seed + (unsigned int) i;
+
+		pthread_create(&threads[i], NULL, reader_thread, &rs[i]);
+	}
+
+	struct timespec deadline = deadline_after(opts.duration + STUCK_TIME);
+
+	pthread_mutex_lock(&lock);
+
+	while (b.done < readers && pthread_cond_timedwait(&signal_cond, &lock,
+			&deadline) != ETIMEDOUT);
+
+	bool stuck = b.done < readers;
+
+	pthread_mutex_unlock(&lock);
+
+	// A lost wakeup leaves reads waiting for good, don't wait with them
+	if (stuck) {
+		fprintf(stderr, "%d readers still waiting %d ms after the run\n",
+			readers - b.done, STUCK_TIME);
+		exit(2);
+	}
+
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+
+	uint64_t elapsed = now_us() - start;
+
+	pthread_mutex_lock(&lock);
+	pthread_mutex_lock(&pieces.disk_lock);
+
+	pieces.stop = true;
+
+	pthread_mutex_unlock(&pieces.disk_lock);
+	pthread_mutex_unlock(&lock);
+
+	pthread_cond_broadcast(&pieces.disk_cond);
+
+	pthread_join(swarm, NULL);
+
+	for (size_t i = 0; i < disks.size(); i++)
+		pthread_join(disks[i], NULL);
+
+	std::vector<uint64_t> latencies;
+	int64_t bytes = 0, errors = 0, corrupt = 0;
+
+	for (size_t i = 0; i < rs.size(); i++) {
+		latencies.insert(latencies.end(), rs[i].latencies.begin(),
+			rs[i].latencies.end());
+
+		bytes += rs[i].bytes;
+		errors += rs[i].errors;
+		corrupt += rs[i].corrupt;
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+
+	double rate = (double) bytes / (1 << 20) / ((double) elapsed / 1e6);
+
+	printf("%7d %9zu %9.1f %9" PRIu64 " %9" PRIu64 " %9" PRIu64
+		" %9" PRId64 " %7" PRId64 "\n", readers, latencies.size(), rate,
+		percentile(latencies, 50), percentile(latencies, 99),
+		latencies.empty() ? 0 : latencies.back(), pieces.issued,
+		errors);
+
+	if (corrupt > 0)
+		fprintf(stderr, "%" PRId64 " reads returned wrong data\n",
+			corrupt);
+
+	if (rate < opts.min_rate)
+		fprintf(stderr, "%d readers read less than %d MiB/s\n", readers,
+			opts.min_rate);
+
+	bool slow = opts.max_p99 > 0 &&
+		percentile(latencies, 99) > (uint64_t) opts.max_p99 * 1000;
+
+	if (slow)
+		fprintf(stderr, "%d readers waited more than %d ms at p99\n",
+			readers, opts.max_p99);
+
+	return corrupt == 0 && rate >= opts.min_rate && !slow;
+}
+
+static void
+usage(const char *name) {
+	printf("Usage: %s [options]\n", name);
+	printf("\n");
+	printf("Measures how the btfs read path scales with concurrent readers,\n");
+	printf("on top of a fake torrent. Runs with 1, 2, 4, ... readers.\n");
+	printf("\n");
+	printf("    --readers=N            largest number of readers (default 256)\n");
+	printf("    --pieces=N             number of pieces (default 1024)\n");
+	printf("    --piece-size=N         piece size in KiB (default 1024)\n");
+	printf("    --read-size=N          read size in KiB (default 128)\n");
+	printf("    --latency=N            piece read latency in us (default 100)\n");
+	printf("    --disk-threads=N       concurrent piece reads (default 4)\n");
+	printf("    --failures=N           percent of piece reads failing (default 0)\n");
+	printf("    --have=N               percent of pieces downloaded (default 100)\n");
+	printf("    --piece-time=N         us to download a piece (default 1000)\n");
+	printf("    --duration=N           ms of reads per run, missing pieces arrive at\n");
+	printf("                           once after that (default 1000)\n");
+	printf("    --min-rate=N           fail if a run reads less than N MiB/s\n");
+	printf("    --max-p99=N            fail if a run's p99 latency is over N ms\n");
+	printf("    --seed=N               random seed\n");
+}
+
+int
+main(int argc, char *argv[]) {
+	static const struct option options[] = {
+		{ "readers", required_argument, NULL, 'r' },
+		{ "pieces", required_argument, NULL, 'p' },
+		{ "piece-size", required_argument, NULL, 'P' },
+		{ "read-size", required_argument, NULL, 'R' },
+		{ "latency", required_argument, NULL, 'l' },
+		{ "disk-threads", required_argument, NULL, 'd' },
+		{ "failures", required_argument, NULL, 'f' },
+		{ "have", required_argument, NULL, 'H' },
+		{ "piece-time", required_argument, NULL, 't' },
+		{ "duration", required_argument, NULL, 'D' },
+		{ "min-rate", required_argument, NULL, 'm' },
+		{ "max-p99", required_argument, NULL, 'L' },
+		{ "seed", required_argument, NULL, 's' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	for (int c; (c = getopt_long(argc, argv, "h", options, NULL)) != -1;) {
+		switch (c) {
+		case 'r':
+			opts.readers = atoi(optarg);
+			break;
+		case 'p':
+			opts.pieces = atoi(optarg);
+			break;
+		case 'P':
+			opts.piece_size = atoi(optarg);
+			break;
+		case 'R':
+			opts.read_size = atoi(optarg);
+			break;
+		case 'l':
+			opts.latency = atoi(optarg);
+			break;
+		case 'd':
+			opts.disk_threads = atoi(optarg);
+			break;
+		case 'f':
+			opts.failures = atoi(optarg);
+			break;
+		case 'H':
+			opts.have = atoi(optarg);
+			break;
+		case 't':
+			opts.piece_time = atoi(optarg);
+			break;
+		case 'D':
+			opts.duration = atoi(optarg);
+			break;
+		case 'm':
+			opts.min_rate = atoi(optarg);
+			break;
+		case 'L':
+			opts.max_p99 = atoi(optarg);
+			break;
+		case 's':
+			opts.seed = (unsigned int) strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc || opts.readers <= 0 || opts.pieces <= 0 ||
+			opts.piece_size <= 0 || opts.read_size <= 0 ||
+			opts.latency < 0 || opts.disk_threads <= 0 ||
+			opts.piece_time < 0 || opts.duration <= 0 ||
+			opts.min_rate < 0 || opts.max_p99 < 0 ||
+			(int64_t) opts.read_size > (int64_t) opts.pieces *
+			opts.piece_size) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	printf("readers     reads     MiB/s    p50 us    p99 us    max us"
+		"  disk ops  errors\n");
+
+	std::vector<int> counts;
+
+	for (int n = 1; n < opts.readers; n *= 2)
+		counts.push_back(n);
+
+	counts.push_back(opts.readers);
+
+	bool ok = true;
+
+	for (size_t i = 0; i < counts.size(); i++)
+		ok = run(counts[i]) && ok;
+
+	return ok ? 0 : 2;
+}
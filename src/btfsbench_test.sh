@@ -0,0 +1,9 @@
+#!/bin/sh
+
+# Concurrent reads of a fake torrent return the right data, fast enough
+./btfsbench --readers=16 --duration=200 --min-rate=5 || exit 1
+
+# Also while pieces are still downloading and some reads fail. No read
+# waits much longer than the run, unless a wakeup gets lost.
+./btfsbench --readers=16 --duration=200 --have=50 --failures=5 \
+	--max-p99=1000 || exit 1
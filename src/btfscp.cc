@@ -0,0 +1,480 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "btfsstat.h"
+
+// Largest read through the mount
+#define CHUNK_SIZE (1024 * 1024)
+
+// Milliseconds to wait for a piece before looking again anyway
+#define WAIT_TIMEOUT 1000
+
+using namespace btfs;
+
+// A file being copied
+struct Copy {
+	std::string source;
+	std::string destination;
+
+	int in = -1;
+	int out = -1;
+
+	// The file as downloaded by btfs, if it can be read directly
+	int backing = -1;
+
+	off_t size = 0;
+
+	// Byte ranges copied so far, start -> end, in swarm order
+	std::map<off_t,off_t> copied;
+};
+
+static void
+usage(const char *name) {
+	printf("Usage: %s [-n] [-s] SOURCE DESTINATION\n", name);
+}
+
+// Path of the file backing source on disk, empty if there is none
+static std::string
+backing_path(const char *source) {
+	char path[PATH_MAX];
+
+#ifdef __APPLE__
+	ssize_t n = getxattr(source, XATTR_BACKING_PATH, path,
+		sizeof (path) - 1, 0, 0);
+#else
+	ssize_t n = getxattr(source, XATTR_BACKING_PATH, path,
+		sizeof (path) - 1);
+#endif
+
+	if (n <= 0)
+		return std::string();
+
+	return std::string(path, (size_t) n);
+}
+
+static void
+set_xattr(const std::string& path, const char *key, const char *value) {
+#ifdef __APPLE__
+	setxattr(path.c_str(), key, value, strlen(value), 0, 0);
+#else
+	setxattr(path.c_str(), key, value, strlen(value), 0);
+#endif
+}
+
+static bool
+write_all(int fd, const char *buf, size_t length, off_t offset) {
+	while (length > 0) {
+		ssize_t n = pwrite(fd, buf, length, offset);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			return false;
+
+		buf += n;
+		length -= (size_t) n;
+		offset += n;
+	}
+
+	return true;
+}
+
+// Copy up to length bytes at offset, returns the number copied, 0 at the
+// end of in, or -1
+static ssize_t
+read_write(int in, int out, off_t offset, size_t length,
+		std::vector<char>& buf) {
+	ssize_t n;
+
+	do {
+		n = pread(in, buf.data(), std::min(length, buf.size()), offset);
+	} while (n < 0 && errno == EINTR);
+
+	if (n > 0 && !write_all(out, buf.data(), (size_t) n, offset))
+		return -1;
+
+	return n;
+}
+
+// Copy the bytes from offset to end
+static bool
+copy_range(int in, int out, off_t offset, off_t end,
+		std::vector<char>& buf) {
+	while (offset < end) {
+		ssize_t n = read_write(in, out, offset, (size_t) (end - offset),
+			buf);
+
+		if (n <= 0)
+			return false;
+
+		offset += n;
+	}
+
+	return true;
+}
+
+#ifdef __linux__
+// Copy length bytes at offset of the backing file in the kernel, which
+// reflinks them if both files are on a filesystem that can. Returns false
+// if the kernel can't, then the caller copies them itself.
+static bool
+offload(int in, int out, off_t offset, off_t length) {
+	loff_t o = offset;
+
+	while (length > 0) {
+		ssize_t n = copy_file_range(in, &o, out, &o, (size_t) length, 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			return false;
+
+		length -= n;
+	}
+
+	return true;
+}
+#endif
+
+// Copy downloaded bytes from offset to end, from the backing file if
+// possible. Cross-filesystem copies are not supported everywhere.
+static bool
+copy_downloaded(Copy& c, off_t offset, off_t end, std::vector<char>& buf) {
+#ifdef __linux__
+	if (c.backing >= 0 && offload(c.backing, c.out, offset, end - offset))
+		return true;
+#endif
+
+	if (c.backing >= 0 && copy_range(c.backing, c.out, offset, end, buf))
+		return true;
+
+	return copy_range(c.in, c.out, offset, end, buf);
+}
+
+// Where source goes when copied to destination
+static std::string
+target(const std::string& source, const std::string& destination) {
+	struct stat d;
+
+	// Copy into a directory under the same name
+	if (stat(destination.c_str(), &d) == 0 && S_ISDIR(d.st_mode)) {
+		std::string base(source);
+
+		return destination + "/" + std::string(basename(&base[0]));
+	}
+
+	return destination;
+}
+
+// Open the files to copy source to destination, recursing into
+// directories
+static bool
+collect(const std::string& source, const std::string& destination,
+		bool offloading, std::vector<Copy>& copies, const char *name) {
+	struct stat s;
+
+	if (stat(source.c_str(), &s) < 0) {
+		printf("%s: failed to open %s: %s\n", name, source.c_str(),
+			strerror(errno));
+		return false;
+	}
+
+	if (S_ISDIR(s.st_mode)) {
+		if (mkdir(destination.c_str(), 0755) < 0 && errno != EEXIST) {
+			printf("%s: failed to create %s: %s\n", name,
+				destination.c_str(), strerror(errno));
+			return false;
+		}
+
+		DIR *dp = opendir(source.c_str());
+
+		if (!dp)
+			return false;
+
+		bool ok = true;
+
+		for (struct dirent *ep = readdir(dp); ep && ok; ep = readdir(dp)) {
+			std::string f(ep->d_name);
+
+			if (f != "." && f != "..")
+				ok = collect(source + "/" + f, destination + "/" + f,
+					offloading, copies, name);
+		}
+
+		closedir(dp);
+
+		return ok;
+	}
+
+	Copy c;
+
+	c.source = source;
+	c.destination = destination;
+	c.size = s.st_size;
+	c.in = open(source.c_str(), O_RDONLY);
+
+	if (c.in < 0) {
+		printf("%s: failed to open %s: %s\n", name, source.c_str(),
+			strerror(errno));
+		return false;
+	}
+
+	c.out = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (c.out < 0 || ftruncate(c.out, c.size) < 0) {
+		printf("%s: failed to create %s: %s\n", name, destination.c_str(),
+			strerror(errno));
+
+		if (c.out >= 0)
+			close(c.out);
+
+		close(c.in);
+		return false;
+	}
+
+	std::string path = offloading ? backing_path(source.c_str()) :
+		std::string();
+
+	if (!path.empty())
+		c.backing = open(path.c_str(), O_RDONLY);
+
+	copies.push_back(c);
+
+	return true;
+}
+
+static void
+close_copy(Copy& c) {
+	if (c.backing >= 0)
+		close(c.backing);
+
+	close(c.out);
+	close(c.in);
+}
+
+// Copy a file from start to end, waiting for each missing part in turn
+static bool
+copy_in_order(Copy& c, std::vector<char>& buf, const char *name) {
+	for (off_t offset = 0; offset < c.size;) {
+		off_t length = std::min((off_t) CHUNK_SIZE, c.size - offset);
+
+#ifdef __linux__
+		if (c.backing >= 0) {
+			off_t data = lseek(c.in, offset, SEEK_DATA);
+			off_t hole = data == offset ? lseek(c.in, offset, SEEK_HOLE) :
+				-1;
+
+			// Downloaded and verified, no need to go through the mount
+			if (hole > offset && copy_downloaded(c, offset, hole, buf)) {
+				offset = hole;
+				continue;
+			}
+
+			if (data > offset) {
+				// Stop reading through the mount where downloaded data starts
+				length = std::min(length, data - offset);
+			}
+		}
+#endif
+
+		// Not downloaded yet, wait for it through the mount
+		ssize_t n = read_write(c.in, c.out, offset, (size_t) length, buf);
+
+		if (n <= 0) {
+			printf("%s: failed to copy %s: %s\n", name, c.source.c_str(),
+				n == 0 ? "unexpected end of file" : strerror(errno));
+			return false;
+		}
+
+		offset += n;
+	}
+
+	return true;
+}
+
+// Mark offset to end as copied, merging adjacent ranges
+static void
+add_copied(std::map<off_t,off_t>& copied, off_t offset, off_t end) {
+	std::map<off_t,off_t>::iterator i = copied.upper_bound(offset);
+
+	if (i != copied.begin() && std::prev(i)->second >= offset) {
+		--i;
+		offset = i->first;
+	}
+
+	while (i != copied.end() && i->first <= end) {
+		end = std::max(end, i->second);
+		i = copied.erase(i);
+	}
+
+	copied[offset] = end;
+}
+
+static bool
+is_copied(const Copy& c) {
+	return c.size == 0 || (c.copied.size() == 1 &&
+		c.copied.begin()->first == 0 && c.copied.begin()->second >= c.size);
+}
+
+// Copy the downloaded parts of a file not copied before
+static bool
+copy_finished(Copy& c, std::vector<char>& buf) {
+#ifdef __linux__
+	for (off_t offset = 0; offset < c.size;) {
+		off_t data = lseek(c.in, offset, SEEK_DATA);
+
+		// Nothing more downloaded
+		if (data < 0)
+			return errno == ENXIO;
+
+		off_t hole = lseek(c.in, data, SEEK_HOLE);
+
+		if (hole < 0)
+			return false;
+
+		for (off_t o = data; o < hole;) {
+			std::map<off_t,off_t>::iterator i = c.copied.upper_bound(o);
+
+			// Skip what is copied already
+			if (i != c.copied.begin() && std::prev(i)->second > o) {
+				o = std::prev(i)->second;
+				continue;
+			}
+
+			off_t end = i == c.copied.end() ? hole :
+				std::min(hole, i->first);
+
+			if (!copy_downloaded(c, o, end, buf))
+				return false;
+
+			add_copied(c.copied, o, end);
+
+			o = end;
+		}
+
+		offset = hole;
+	}
+
+	return true;
+#else
+	errno = ENOTSUP;
+
+	return false;
+#endif
+}
+
+// Copy files as their pieces finish, in whatever order the swarm
+// delivers them
+static bool
+copy_swarm_order(std::vector<Copy>& copies, std::vector<char>& buf,
+		const char *name) {
+	if (copies.empty())
+		return true;
+
+	// Reads through the mount must not move the foreground window
+	set_xattr(copies[0].source, XATTR_CLASS, "background");
+
+	char range[64];
+
+	snprintf(range, sizeof (range), "0:0:%d", PREFETCH_PRIORITY);
+
+	// All pieces wanted at the same priority are fetched rarest first
+	for (size_t i = 0; i < copies.size(); i++)
+		set_xattr(copies[i].source, XATTR_PREFETCH, range);
+
+	struct btfs_wait w;
+
+	w.finished = -1;
+
+	for (;;) {
+		Copy *waiting = NULL;
+
+		for (size_t i = 0; i < copies.size(); i++) {
+			if (is_copied(copies[i]))
+				continue;
+
+			if (!copy_finished(copies[i], buf)) {
+				printf("%s: failed to copy %s: %s\n", name,
+					copies[i].source.c_str(), strerror(errno));
+				return false;
+			}
+
+			if (!is_copied(copies[i]) && !waiting)
+				waiting = &copies[i];
+		}
+
+		if (!waiting)
+			return true;
+
+		w.timeout = WAIT_TIMEOUT;
+
+		// Not btfs, or an older one, look again in a while
+		if (ioctl(waiting->in, BTFS_IOC_WAIT, &w) < 0)
+			sleep(1);
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	bool offloading = true;
+	bool swarm_order = false;
+
+	for (int c; (c = getopt(argc, argv, "nsh")) != -1;) {
+		switch (c) {
+		case 'n':
+			offloading = false;
+			break;
+		case 's':
+			swarm_order = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	std::vector<Copy> copies;
+
+	bool ok = collect(argv[optind], target(argv[optind], argv[optind + 1]),
+		offloading, copies, argv[0]);
+
+	std::vector<char> buf(CHUNK_SIZE);
+
+	if (ok && swarm_order) {
+		ok = copy_swarm_order(copies, buf, argv[0]);
+	} else {
+		for (size_t i = 0; ok && i < copies.size(); i++)
+			ok = copy_in_order(copies[i], buf, argv[0]);
+	}
+
+	for (size_t i = 0; i < copies.size(); i++)
+		close_copy(copies[i]);
+
+	return ok ? 0 : 2;
+}
@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include <string>
+
+#include "btfsstat.h"
+
+using namespace btfs;
+
+static void
+usage(const char *name) {
+	printf("Usage: %s [-p PRIORITY] [-o OFFSET] [-l LENGTH] FILES...\n",
+		name);
+}
+
+int
+main(int argc, char *argv[]) {
+	int64_t offset = 0;
+	int64_t length = 0;
+	int priority = PREFETCH_PRIORITY;
+
+	for (int c; (c = getopt(argc, argv, "p:o:l:h")) != -1;) {
+		switch (c) {
+		case 'p':
+			priority = atoi(optarg);
+			break;
+		case 'o':
+			offset = strtoll(optarg, NULL, 10);
+			break;
+		case 'l':
+			length = strtoll(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind >= argc || priority < 1 ||
+			priority > PREFETCH_PRIORITY_MAX || offset < 0 ||
+			length < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	char range[64];
+
+	// Zero length prefetches to the end of the file
+	snprintf(range, sizeof (range), "%" PRId64 ":%" PRId64 ":%d", offset,
+		length, priority);
+
+	int ret = 0;
+
+	for (int i = optind; i < argc; i++) {
+#ifdef __APPLE__
+		if (setxattr(argv[i], XATTR_PREFETCH, range, strlen(range), 0,
+				0) < 0) {
+#else
+		if (setxattr(argv[i], XATTR_PREFETCH, range, strlen(range),
+				0) < 0) {
+#endif
+			printf("%s: failed to prefetch %s: %s\n", argv[0], argv[i],
+				strerror(errno));
+			ret = 2;
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,420 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <algorithm>
+
+#include "window.h"
+
+using namespace btfs;
+
+struct sim_file {
+	int64_t offset;
+	int64_t size;
+};
+
+struct sim_read {
+	// Start and duration in the recorded run, in microseconds
+	uint64_t start;
+	uint64_t duration;
+	int file;
+	int64_t offset;
+	int64_t size;
+};
+
+struct sim_peer {
+	std::vector<bool> has;
+	// Piece being downloaded, or -1 if idle
+	int piece;
+	double done_at;
+};
+
+class SimPieces : public PieceSource
+{
+public:
+	SimPieces(int n, int priority) : have((size_t) n, false),
+			priority((size_t) n, priority) {
+	}
+
+	int num_pieces() {
+		return (int) have.size();
+	}
+
+	bool have_piece(int piece) {
+		return have[(size_t) piece];
+	}
+
+	int piece_priority(int piece) {
+		return priority[(size_t) piece];
+	}
+
+	void piece_priority(int piece, int p) {
+		priority[(size_t) piece] = p;
+	}
+
+	std::vector<bool> have;
+
+	std::vector<int> priority;
+};
+
+static struct {
+	int peers = 8;
+	int bandwidth = 1024;
+	int latency = 50;
+	int availability = 100;
+	int window = WINDOW_SIZE;
+	int background = 1;
+	int max_stall = -1;
+	unsigned int seed = 1;
+} opts;
+
+static int64_t piece_length;
+static int num_pieces;
+static int64_t total_size;
+static std::vector<sim_file> files;
+static std::vector<sim_read> reads;
+
+static int64_t
+piece_size(int piece) {
+	return std::min(piece_length, total_size - piece * piece_length);
+}
+
+static bool
+parse(const char *path) {
+	std::ifstream in(path);
+
+	if (!in.is_open())
+		return false;
+
+	for (std::string line; std::getline(in, line);) {
+		std::istringstream l(line);
+		std::string kind;
+
+		l >> kind;
+
+		if (kind == "torrent") {
+			l >> piece_length >> num_pieces >> total_size;
+		} else if (kind == "file") {
+			int index;
+			sim_file f;
+
+			l >> index >> f.offset >> f.size;
+
+			if (index >= 0 && (size_t) index >= files.size())
+				files.resize((size_t) index + 1);
+
+			if (index >= 0)
+				files[(size_t) index] = f;
+		} else if (kind == "read") {
+			sim_read r;
+
+			l >> r.start >> r.duration >> r.file >> r.offset >> r.size;
+
+			if (l && r.file >= 0 && (size_t) r.file < files.size())
+				reads.push_back(r);
+		}
+	}
+
+	return piece_length > 0 && num_pieces > 0;
+}
+
+// Pieces covered by a read, clipped to the end of the file
+static bool
+covers(const sim_read& r, int& first, int& last) {
+	const sim_file& f = files[(size_t) r.file];
+
+	int64_t size = std::min(r.size, f.size - r.offset);
+
+	if (size <= 0)
+		return false;
+
+	first = (int) ((f.offset + r.offset) / piece_length);
+	last = (int) ((f.offset + r.offset + size - 1) / piece_length);
+
+	return true;
+}
+
+static void
+usage(const char *name) {
+	printf("Usage: %s [options] ACCESS_LOG\n", name);
+	printf("\n");
+	printf("Replays reads logged by btfs --access-log against a model\n");
+	printf("swarm, using the same sliding window as btfs.\n");
+	printf("\n");
+	printf("    --peers=N              number of peers (default 8)\n");
+	printf("    --bandwidth=N          per peer bandwidth in kB/s (default 1024)\n");
+	printf("    --latency=N            per piece request latency in ms (default 50)\n");
+	printf("    --availability=N       percent of pieces each peer has (default 100)\n");
+	printf("    --window=N             pieces in the sliding window (default %d)\n",
+		WINDOW_SIZE);
+	printf("    --no-background        only download pieces in the window\n");
+	printf("    --seed=N               random seed for piece availability\n");
+	printf("    --max-stall=N          fail if reads stall more than N ms in total\n");
+}
+
+int
+main(int argc, char *argv[]) {
+	static const struct option options[] = {
+		{ "peers", required_argument, NULL, 'p' },
+		{ "bandwidth", required_argument, NULL, 'b' },
+		{ "latency", required_argument, NULL, 'l' },
+		{ "availability", required_argument, NULL, 'a' },
+		{ "window", required_argument, NULL, 'w' },
+		{ "no-background", no_argument, NULL, 'n' },
+		{ "seed", required_argument, NULL, 's' },
+		{ "max-stall", required_argument, NULL, 'm' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	for (int c; (c = getopt_long(argc, argv, "h", options, NULL)) != -1;) {
+		switch (c) {
+		case 'p':
+			opts.peers = atoi(optarg);
+			break;
+		case 'b':
+			opts.bandwidth = atoi(optarg);
+			break;
+		case 'l':
+			opts.latency = atoi(optarg);
+			break;
+		case 'a':
+			opts.availability = atoi(optarg);
+			break;
+		case 'w':
+			opts.window = atoi(optarg);
+			break;
+		case 'n':
+			opts.background = 0;
+			break;
+		case 's':
+			opts.seed = (unsigned int) strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			opts.max_stall = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1 || opts.peers <= 0 || opts.bandwidth <= 0 ||
+			opts.latency < 0 || opts.window <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!parse(argv[optind])) {
+		fprintf(stderr, "%s: failed to parse %s\n", argv[0],
+			argv[optind]);
+		return 2;
+	}
+
+	// Unprioritized pieces are downloaded in the background, like
+	// libtorrent does with its default priority
+	SimPieces pieces(num_pieces, opts.background ? 4 : 0);
+
+	Window window(&pieces, opts.window);
+
+	std::mt19937 rng(opts.seed);
+	std::uniform_int_distribution<int> percent(0, 99);
+	std::uniform_int_distribution<int> any(0, opts.peers - 1);
+
+	std::vector<sim_peer> peers((size_t) opts.peers);
+	std::vector<int> rarity((size_t) num_pieces, 0);
+
+	for (size_t i = 0; i < peers.size(); i++) {
+		peers[i].has.assign((size_t) num_pieces, false);
+		peers[i].piece = -1;
+		peers[i].done_at = 0;
+
+		for (size_t j = 0; j < (size_t) num_pieces; j++) {
+			if (percent(rng) < opts.availability) {
+				peers[i].has[j] = true;
+				rarity[j]++;
+			}
+		}
+	}
+
+	// Every piece must exist somewhere in the swarm
+	for (size_t j = 0; j < (size_t) num_pieces; j++) {
+		if (rarity[j] == 0) {
+			peers[(size_t) any(rng)].has[j] = true;
+			rarity[j]++;
+		}
+	}
+
+	std::vector<bool> downloading((size_t) num_pieces, false);
+	std::vector<bool> needed((size_t) num_pieces, false);
+
+	double bytes_per_second = opts.bandwidth * 1024.0;
+	double now = 0;
+	double stall = 0;
+	double max_stall = 0;
+	double recorded_stall = 0;
+	int64_t downloaded = 0;
+
+	// Time at which the next read is issued, and whether it is
+	size_t next = 0;
+	double issue_at = 0;
+	bool issued = false;
+
+	for (size_t i = 0; i < reads.size(); i++) {
+		int first, last;
+
+		recorded_stall += (double) reads[i].duration / 1e6;
+
+		if (!covers(reads[i], first, last))
+			continue;
+
+		for (int j = first; j <= last; j++)
+			needed[(size_t) j] = true;
+	}
+
+	while (next < reads.size()) {
+		int first = 0, last = -1;
+
+		covers(reads[next], first, last);
+
+		if (!issued && issue_at <= now) {
+			issued = true;
+			issue_at = now;
+
+			// Move sliding window to first piece to serve this request
+			window.jump(first, (int) reads[next].size);
+		}
+
+		if (issued) {
+			bool done = true;
+
+			for (int j = first; j <= last && done; j++)
+				done = pieces.have_piece(j);
+
+			if (done) {
+				stall += now - issue_at;
+				max_stall = std::max(max_stall, now - issue_at);
+
+				next++;
+				issued = false;
+
+				// Keep the recorded think time between reads
+				if (next < reads.size()) {
+					uint64_t end = reads[next - 1].start +
+						reads[next - 1].duration;
+
+					if (reads[next].start > end)
+						issue_at = now + (double) (
+							reads[next].start - end) / 1e6;
+					else
+						issue_at = now;
+				}
+
+				continue;
+			}
+		}
+
+		// Let idle peers pick a piece, highest priority and rarest first
+		for (size_t i = 0; i < peers.size(); i++) {
+			if (peers[i].piece >= 0)
+				continue;
+
+			int best = -1;
+
+			for (int j = 0; j < num_pieces; j++) {
+				size_t u = (size_t) j;
+
+				if (!peers[i].has[u] || pieces.have[u] ||
+						downloading[u] ||
+						pieces.priority[u] <= 0)
+					continue;
+
+				if (best < 0 ||
+						pieces.priority[u] >
+						pieces.priority[(size_t) best] ||
+						(pieces.priority[u] ==
+						pieces.priority[(size_t) best] &&
+						rarity[u] < rarity[(size_t) best]))
+					best = j;
+			}
+
+			if (best < 0)
+				continue;
+
+			downloading[(size_t) best] = true;
+			peers[i].piece = best;
+			peers[i].done_at = now + opts.latency / 1000.0 +
+				(double) piece_size(best) / bytes_per_second;
+		}
+
+		// Move time to the next event
+		double until = -1;
+
+		if (!issued)
+			until = issue_at;
+
+		for (size_t i = 0; i < peers.size(); i++) {
+			if (peers[i].piece >= 0 &&
+					(until < 0 || peers[i].done_at < until))
+				until = peers[i].done_at;
+		}
+
+		if (until < 0) {
+			fprintf(stderr, "%s: read %zu can never finish\n",
+				argv[0], next);
+			return 3;
+		}
+
+		now = std::max(now, until);
+
+		for (size_t i = 0; i < peers.size(); i++) {
+			if (peers[i].piece < 0 || peers[i].done_at > now)
+				continue;
+
+			size_t p = (size_t) peers[i].piece;
+
+			pieces.have[p] = true;
+			downloading[p] = false;
+			downloaded += piece_size(peers[i].piece);
+
+			peers[i].piece = -1;
+
+			// Advance sliding window
+			window.advance();
+		}
+	}
+
+	int64_t wasted = 0;
+
+	for (int j = 0; j < num_pieces; j++) {
+		if (pieces.have[(size_t) j] && !needed[(size_t) j])
+			wasted += piece_size(j);
+	}
+
+	double capacity = now * bytes_per_second * opts.peers;
+
+	printf("reads:            %zu\n", reads.size());
+	printf("simulated time:   %.3f s\n", now);
+	printf("stall time:       %.3f s (recorded %.3f s)\n", stall,
+		recorded_stall);
+	printf("max stall:        %.3f s\n", max_stall);
+	printf("downloaded:       %" PRId64 " bytes\n", downloaded);
+	printf("wasted:           %" PRId64 " bytes\n", wasted);
+	printf("bandwidth use:    %.1f%%\n",
+		capacity > 0 ? 100.0 * (double) downloaded / capacity : 0.0);
+
+	if (opts.max_stall >= 0 && stall * 1000 > opts.max_stall) {
+		fprintf(stderr, "%s: reads stalled more than %d ms\n", argv[0],
+			opts.max_stall);
+		return 4;
+	}
+
+	return 0;
+}
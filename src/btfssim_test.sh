@@ -0,0 +1,24 @@
+#!/bin/sh
+
+log=btfssim_test.log
+
+# A sequential reader of a 64 MiB file, one 128 KiB read every 50 ms
+{
+	echo "torrent 1048576 64 67108864"
+	echo "file 0 0 67108864"
+
+	i=0
+	while [ $i -lt 512 ]; do
+		echo "read $((i * 50000)) 1000 0 $((i * 131072)) 131072"
+		i=$((i + 1))
+	done
+} > $log
+
+# Only the first piece stalls the reader, the sliding window fetches the
+# rest ahead of it
+./btfssim --max-stall=2000 $log
+ret=$?
+
+rm -f $log
+
+exit $ret
@@ -5,8 +5,59 @@
 #define XATTR_IS_BTFS_ROOT "user.btfs.is_btfs_root"
 #define XATTR_IS_BTFS "user.btfs.is_btfs"
 
+// Read-only identity of a file's content. Hashes are hex, the info-hash
+// is the v1 one for v1 and hybrid torrents. The Merkle root is only there
+// for v2 and hybrid torrents, the piece hashes for v1 and hybrid ones.
+#define XATTR_INFO_HASH "user.btfs.info_hash"
+#define XATTR_MERKLE_ROOT "user.btfs.merkle_root"
+#define XATTR_PIECE_SIZE "user.btfs.piece_size"
+
+// "FIRST-LAST" pieces the file is in, and their SHA-1 hashes
+#define XATTR_PIECES "user.btfs.pieces"
+#define XATTR_PIECE_HASHES "user.btfs.piece_hashes"
+
+// "1" once all those pieces have passed their hash check, otherwise "0"
+#define XATTR_VERIFIED "user.btfs.verified"
+
+// Path of the file as downloaded to disk. Downloaded pieces, as reported
+// by SEEK_DATA and SEEK_HOLE, can be copied from it directly.
+#define XATTR_BACKING_PATH "user.btfs.backing_path"
+
+// Write-only, "OFFSET:LENGTH[:PRIORITY]" ranges separated by commas
+#define XATTR_PREFETCH "user.btfs.prefetch"
+
+// Class of the calling process, "foreground" (default) or "background"
+#define XATTR_CLASS "user.btfs.class"
+
+// Default and maximum priority of prefetched pieces
+#define PREFETCH_PRIORITY 6
+#define PREFETCH_PRIORITY_MAX 7
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
 namespace btfs
 {
+
+struct btfs_available {
+	// In: offset into the file
+	int64_t offset;
+	// Out: number of contiguous bytes downloaded from offset
+	int64_t length;
+};
+
+struct btfs_wait {
+	// In: number of pieces finished when last asked, out: the number now
+	int64_t finished;
+	// In: milliseconds to wait for it to change, at most
+	int64_t timeout;
+};
+
 }
 
+#define BTFS_IOC_AVAILABLE _IOWR('B', 1, struct btfs::btfs_available)
+
+// Wait for any piece of the torrent to finish
+#define BTFS_IOC_WAIT _IOWR('B', 2, struct btfs::btfs_wait)
+
 #endif
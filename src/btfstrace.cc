@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <map>
+
+#include "btfstrace.h"
+
+using namespace btfs;
+
+static const char *
+name(uint32_t type) {
+	switch (type) {
+	case TRACE_WINDOW:
+		return "window";
+	case TRACE_PRIORITY:
+		return "priority";
+	case TRACE_FIRST_BLOCK:
+		return "first_block";
+	case TRACE_FINISHED:
+		return "finished";
+	case TRACE_READ_ISSUED:
+		return "read_piece";
+	case TRACE_READ_DONE:
+		return "read_piece_alert";
+	case TRACE_DELIVERED:
+		return "delivered";
+	case TRACE_DEADLINE:
+		return "deadline";
+	default:
+		return "unknown";
+	}
+}
+
+// Microseconds from start to t, 0 for events written out of order by
+// older versions of btfs
+static uint64_t
+since(uint64_t start, uint64_t t) {
+	return t > start ? t - start : 0;
+}
+
+static void
+instant(FILE *out, const trace_event& e, uint64_t start, bool& first) {
+	fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+		"\"ts\":%" PRIu64 ",\"pid\":1,\"tid\":%" PRId32 ","
+		"\"args\":{\"value\":%" PRId64 "}}", first ? "" : ",",
+		name(e.type), since(start, e.time), e.piece, e.value);
+
+	first = false;
+}
+
+static void
+slice(FILE *out, const char *n, int32_t piece, uint64_t from, uint64_t to,
+		uint64_t start, bool& first) {
+	fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\","
+		"\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"pid\":1,"
+		"\"tid\":%" PRId32 "}", first ? "" : ",", n, since(start, from),
+		since(from, to), piece);
+
+	first = false;
+}
+
+int
+main(int argc, char *argv[]) {
+	if (argc != 2) {
+		printf("Usage: %s TRACE_FILE > TRACE.json\n", argv[0]);
+		return 1;
+	}
+
+	FILE *in = fopen(argv[1], "rb");
+
+	if (!in) {
+		perror("failed to open trace");
+		return 2;
+	}
+
+	char magic[sizeof (TRACE_MAGIC) - 1];
+
+	if (fread(magic, sizeof (magic), 1, in) != 1 ||
+			memcmp(magic, TRACE_MAGIC, sizeof (magic)) != 0) {
+		fprintf(stderr, "%s: %s is not a btfs trace\n", argv[0],
+			argv[1]);
+		fclose(in);
+		return 3;
+	}
+
+	// Start of the download and the disk read of each piece
+	std::map<int32_t, uint64_t> downloading;
+	// Reads of the same piece may overlap, each done ends the oldest
+	std::multimap<int32_t, uint64_t> reading;
+
+	uint64_t start = 0;
+	bool first = true;
+
+	trace_event e;
+
+	printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+	while (fread(&e, sizeof (e), 1, in) == 1) {
+		if (first)
+			// Make timestamps relative to the first event
+			start = e.time;
+
+		instant(stdout, e, start, first);
+
+		if (e.type == TRACE_WINDOW) {
+			downloading.insert(std::make_pair(e.piece, e.time));
+		} else if (e.type == TRACE_FINISHED &&
+				downloading.count(e.piece)) {
+			slice(stdout, "download", e.piece,
+				downloading[e.piece], e.time, start, first);
+			downloading.erase(e.piece);
+		} else if (e.type == TRACE_READ_ISSUED) {
+			reading.insert(std::make_pair(e.piece, e.time));
+		} else if (e.type == TRACE_READ_DONE &&
+				reading.count(e.piece)) {
+			std::multimap<int32_t, uint64_t>::iterator i =
+				reading.lower_bound(e.piece);
+
+			slice(stdout, "disk_read", e.piece, i->second, e.time,
+				start, first);
+			reading.erase(i);
+		}
+	}
+
+	printf("\n]}\n");
+
+	fclose(in);
+
+	return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef __BTFSTRACE_H__
+#define __BTFSTRACE_H__
+
+#include <stdint.h>
+
+// First bytes of a trace file, followed by trace_event records
+#define TRACE_MAGIC "BTFSTRC1"
+
+namespace btfs
+{
+
+enum trace_type {
+	// Piece entered the sliding window
+	TRACE_WINDOW = 1,
+	// Piece priority was raised (value: new priority)
+	TRACE_PRIORITY,
+	// First block of piece was received from a peer
+	TRACE_FIRST_BLOCK,
+	// Piece passed the hash check
+	TRACE_FINISHED,
+	// read_piece() was issued
+	TRACE_READ_ISSUED,
+	// read_piece_alert arrived (value: error code, 0 on success)
+	TRACE_READ_DONE,
+	// Data was copied to a pending read (value: number of bytes)
+	TRACE_DELIVERED,
+	// Piece was given a deadline (value: milliseconds from now)
+	TRACE_DEADLINE,
+};
+
+struct trace_event {
+	// Microseconds since an arbitrary (monotonic) point in time
+	uint64_t time;
+	int32_t piece;
+	uint32_t type;
+	int64_t value;
+};
+
+}
+
+#endif
@@ -0,0 +1,79 @@
+/*
+Copyright 2015 Johan Gunnarsson <johan.gunnarsson@gmail.com>
+
+This file is part of BTFS.
+
+BTFS is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+BTFS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+
+#include "choke.h"
+
+namespace btfs
+{
+
+int choke_score(const std::set<int>& pieces,
+		const std::function<bool(int)>& has_piece) {
+	int s = 0;
+
+	for (std::set<int>::const_iterator i = pieces.begin();
+			i != pieces.end(); ++i) {
+		if (has_piece(*i))
+			s++;
+	}
+
+	return s;
+}
+
+choke_plan plan_chokes(const std::vector<choke_peer>& peers) {
+	// Choked peers with pieces we need
+	std::vector<size_t> useful;
+
+	// Unchoked peers without any
+	std::vector<size_t> useless;
+
+	for (size_t i = 0; i < peers.size(); i++) {
+		// Nothing to offer to peers that don't want anything from us
+		if (!peers[i].interested)
+			continue;
+
+		if (peers[i].score > 0 && peers[i].choked)
+			useful.push_back(i);
+		else if (peers[i].score == 0 && !peers[i].choked)
+			useless.push_back(i);
+	}
+
+	// Best first
+	std::stable_sort(useful.begin(), useful.end(),
+		[&peers](size_t a, size_t b) {
+			return peers[a].score > peers[b].score;
+		});
+
+	choke_plan plan;
+
+	for (size_t i = 0; i < useful.size(); i++) {
+		// Free a slot, unless there is a spare one already
+		if (!useless.empty()) {
+			plan.choke.push_back(useless.back());
+			useless.pop_back();
+		}
+
+		plan.unchoke.push_back(useful[i]);
+	}
+
+	return plan;
+}
+
+}
@@ -0,0 +1,61 @@
+/*
+Copyright 2015 Johan Gunnarsson <johan.gunnarsson@gmail.com>
+
+This file is part of BTFS.
+
+BTFS is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+BTFS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BTFS_CHOKE_H
+#define BTFS_CHOKE_H
+
+#include <vector>
+#include <set>
+#include <functional>
+#include <cstddef>
+
+namespace btfs
+{
+
+// A connected peer, as seen by the reciprocity plugin
+struct choke_peer {
+	// Whether the peer wants data from us
+	bool interested;
+
+	// Whether we refuse to upload to the peer
+	bool choked;
+
+	// Number of the pieces readers wait for that the peer has
+	int score;
+};
+
+// Peers to choke and to unchoke, by their position in the peers given
+struct choke_plan {
+	std::vector<size_t> choke;
+
+	std::vector<size_t> unchoke;
+};
+
+// Number of the given pieces a peer has
+int choke_score(const std::set<int>& pieces,
+	const std::function<bool(int)>& has_piece);
+
+// Unchoke choked peers that have pieces readers wait for, best first, so
+// that they return the favor. Each takes the slot of an unchoked peer
+// without any such pieces, if there is one.
+choke_plan plan_chokes(const std::vector<choke_peer>& peers);
+
+}
+
+#endif
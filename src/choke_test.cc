@@ -0,0 +1,112 @@
+/*
+Copyright 2015 Johan Gunnarsson <johan.gunnarsson@gmail.com>
+
+This file is part of BTFS.
+
+BTFS is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+BTFS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "choke.h"
+
+using namespace btfs;
+
+static int failures = 0;
+
+static void
+check(bool ok, const std::string& what) {
+	if (!ok) {
+		printf("FAIL: %s\n", what.c_str());
+		failures++;
+	}
+}
+
+static choke_peer
+peer(bool interested, bool choked, int score) {
+	choke_peer p;
+
+	p.interested = interested;
+	p.choked = choked;
+	p.score = score;
+
+	return p;
+}
+
+int
+main() {
+	std::set<int> pieces = { 1, 3, 5 };
+
+	check(choke_score(pieces, [](int p) { return p % 2 == 1; }) == 3,
+		"score of a peer with all pieces");
+	check(choke_score(pieces, [](int p) { return p == 3 || p == 4; }) == 1,
+		"score of a peer with one piece");
+	check(choke_score(std::set<int>(), [](int p) { return true; }) == 0,
+		"score without wanted pieces");
+
+	choke_plan plan = plan_chokes(std::vector<choke_peer>());
+
+	check(plan.choke.empty() && plan.unchoke.empty(), "no peers");
+
+	// Best first, uninterested and unchoked useful peers left alone
+	plan = plan_chokes({
+		peer(true, true, 1),
+		peer(true, true, 3),
+		peer(false, true, 5),
+		peer(true, false, 2),
+		peer(true, true, 0),
+	});
+
+	check(plan.unchoke == std::vector<size_t>({ 1, 0 }),
+		"unchoke useful peers, best first");
+	check(plan.choke.empty(), "no useless peers to choke");
+
+	// Equal scores keep their order
+	plan = plan_chokes({
+		peer(true, true, 2),
+		peer(true, true, 2),
+	});
+
+	check(plan.unchoke == std::vector<size_t>({ 0, 1 }),
+		"equal scores in order");
+
+	// Each unchoke takes the slot of a useless peer while there are any
+	plan = plan_chokes({
+		peer(true, false, 0),
+		peer(true, true, 1),
+		peer(true, false, 0),
+		peer(false, false, 0),
+		peer(true, true, 2),
+		peer(true, true, 4),
+	});
+
+	check(plan.unchoke == std::vector<size_t>({ 5, 4, 1 }),
+		"unchoke with useless peers");
+	check(plan.choke == std::vector<size_t>({ 2, 0 }),
+		"choke useless interested peers only");
+
+	// Nothing to do without useful peers
+	plan = plan_chokes({
+		peer(true, false, 0),
+		peer(true, true, 0),
+	});
+
+	check(plan.choke.empty() && plan.unchoke.empty(),
+		"keep useless peers without useful ones");
+
+	return failures ? 1 : 0;
+}
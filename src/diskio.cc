@@ -0,0 +1,282 @@
+/*
+Copyright 2015 Johan Gunnarsson <johan.gunnarsson@gmail.com>
+
+This file is part of BTFS.
+
+BTFS is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+BTFS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cerrno>
+#include <cstdint>
+
+#include <unistd.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_LIBURING_H
+#include <sys/eventfd.h>
+#endif
+
+#include "diskio.h"
+
+// user_data of the read of the wake up eventfd, buffers use their index
+#define DISKIO_WAKEUP DISKIO_DEPTH
+
+namespace btfs
+{
+
+DiskReader::DiskReader() {
+}
+
+DiskReader::~DiskReader() {
+	stop();
+}
+
+bool DiskReader::start() {
+#ifdef HAVE_LIBURING_H
+	if (started)
+		return true;
+
+	if (io_uring_queue_init(DISKIO_DEPTH * 2, &ring, 0) < 0)
+		return false;
+
+	event_fd = eventfd(0, EFD_CLOEXEC);
+
+	if (event_fd < 0) {
+		io_uring_queue_exit(&ring);
+		return false;
+	}
+
+	buffers.resize((size_t) DISKIO_DEPTH * DISKIO_BUFFER_SIZE);
+
+	std::vector<struct iovec> iov(DISKIO_DEPTH);
+
+	for (size_t i = 0; i < iov.size(); i++) {
+		iov[i].iov_base = buffers.data() + i * DISKIO_BUFFER_SIZE;
+		iov[i].iov_len = DISKIO_BUFFER_SIZE;
+	}
+
+	// May fail on a low RLIMIT_MEMLOCK, plain reads work anyway
+	registered = io_uring_register_buffers(&ring, iov.data(),
+		(unsigned) iov.size()) == 0;
+
+	quit = false;
+	failed = false;
+
+	if (pthread_create(&thread, NULL, loop, this) != 0) {
+		close(event_fd);
+		io_uring_queue_exit(&ring);
+		return false;
+	}
+
+#ifdef HAVE_PTHREAD_SETNAME_NP
+	pthread_setname_np(thread, "diskio");
+#endif
+
+	started = true;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void DiskReader::stop() {
+#ifdef HAVE_LIBURING_H
+	if (!started)
+		return;
+
+	pthread_mutex_lock(&lock);
+
+	quit = true;
+
+	pthread_mutex_unlock(&lock);
+
+	uint64_t one = 1;
+
+	// Only fails if the counter is about to overflow, then the thread
+	// wakes up anyway
+	while (write(event_fd, &one, sizeof (one)) < 0 && errno == EINTR)
+		;
+
+	pthread_join(thread, NULL);
+
+	io_uring_queue_exit(&ring);
+
+	close(event_fd);
+
+	started = false;
+#endif
+}
+
+bool DiskReader::running() {
+	return started;
+}
+
+bool DiskReader::submit(int fd, off_t offset, int length, callback done) {
+	if (!started || length <= 0 || length > DISKIO_BUFFER_SIZE)
+		return false;
+
+	pthread_mutex_lock(&lock);
+
+	if (failed) {
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+
+	request r = { fd, offset, length, done };
+
+	queue.push_back(r);
+
+	// Only the first of a batch needs to wake up the thread
+	bool wake = queue.size() == 1;
+
+	pthread_mutex_unlock(&lock);
+
+	uint64_t one = 1;
+
+	if (wake && write(event_fd, &one, sizeof (one)) < 0)
+		return false;
+
+	return true;
+}
+
+void *DiskReader::loop(void *data) {
+	((DiskReader *) data)->run();
+
+	return NULL;
+}
+
+void DiskReader::abort(std::vector<callback>& inflight) {
+	pthread_mutex_lock(&lock);
+
+	failed = true;
+
+	std::deque<request> queued;
+
+	queued.swap(queue);
+
+	pthread_mutex_unlock(&lock);
+
+	// Without lock held, callers take their own lock in the callback
+	for (size_t i = 0; i < inflight.size(); i++) {
+		if (inflight[i])
+			inflight[i](NULL, -EIO);
+	}
+
+	for (size_t i = 0; i < queued.size(); i++)
+		queued[i].done(NULL, -EIO);
+}
+
+void DiskReader::run() {
+#ifdef HAVE_LIBURING_H
+	std::vector<callback> inflight(DISKIO_DEPTH);
+	std::vector<int> lengths(DISKIO_DEPTH);
+	std::vector<int> idle;
+
+	for (int i = DISKIO_DEPTH - 1; i >= 0; i--)
+		idle.push_back(i);
+
+	uint64_t wakeups;
+
+	bool armed = false;
+	bool stopping = false;
+
+	while (!stopping || idle.size() < DISKIO_DEPTH) {
+		if (!armed && !stopping) {
+			struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+
+			io_uring_prep_read(sqe, event_fd, &wakeups, sizeof (wakeups),
+				0);
+			io_uring_sqe_set_data(sqe, (void *) (uintptr_t) DISKIO_WAKEUP);
+
+			armed = true;
+		}
+
+		// Take as many queued reads as there are free buffers
+		pthread_mutex_lock(&lock);
+
+		stopping = quit;
+
+		while (!queue.empty() && !idle.empty()) {
+			request r = queue.front();
+
+			queue.pop_front();
+
+			int i = idle.back();
+
+			idle.pop_back();
+
+			char *buf = buffers.data() + (size_t) i * DISKIO_BUFFER_SIZE;
+
+			struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+
+			if (registered)
+				io_uring_prep_read_fixed(sqe, r.fd, buf,
+					(unsigned) r.length, (uint64_t) r.offset, i);
+			else
+				io_uring_prep_read(sqe, r.fd, buf, (unsigned) r.length,
+					(uint64_t) r.offset);
+
+			io_uring_sqe_set_data(sqe, (void *) (uintptr_t) i);
+
+			inflight[(size_t) i] = r.done;
+			lengths[(size_t) i] = r.length;
+		}
+
+		pthread_mutex_unlock(&lock);
+
+		if (stopping && idle.size() == DISKIO_DEPTH)
+			break;
+
+		struct io_uring_cqe *cqe;
+
+		// One system call submits the batch and waits for a completion
+		int ret = io_uring_submit_and_wait(&ring, 1);
+
+		if (ret < 0 && ret != -EINTR)
+			break;
+
+		unsigned head, n = 0;
+
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			size_t i = (size_t) (uintptr_t) io_uring_cqe_get_data(cqe);
+
+			n++;
+
+			if (i == DISKIO_WAKEUP) {
+				armed = false;
+				continue;
+			}
+
+			callback done = inflight[i];
+
+			inflight[i] = nullptr;
+
+			if (cqe->res == lengths[i])
+				done(buffers.data() + i * DISKIO_BUFFER_SIZE, cqe->res);
+			else
+				done(NULL, cqe->res < 0 ? cqe->res : -EIO);
+
+			idle.push_back((int) i);
+		}
+
+		io_uring_cq_advance(&ring, n);
+	}
+
+	// Fail what the ring left behind, and anything queued after stopping
+	abort(inflight);
+#endif
+}
+
+}
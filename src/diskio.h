@@ -0,0 +1,110 @@
+/*
+Copyright 2015 Johan Gunnarsson <johan.gunnarsson@gmail.com>
+
+This file is part of BTFS.
+
+BTFS is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+BTFS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BTFS_DISKIO_H
+#define BTFS_DISKIO_H
+
+#include <vector>
+#include <deque>
+#include <functional>
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#ifdef HAVE_LIBURING_H
+#include <liburing.h>
+#endif
+
+// Number of reads in flight, and the size of the buffer of each
+#define DISKIO_DEPTH 32
+#define DISKIO_BUFFER_SIZE (256 * 1024)
+
+namespace btfs
+{
+
+// Reads ranges of downloaded files through io_uring, on a thread of its
+// own. Reads queued by concurrent callers are submitted together, into
+// buffers registered with the kernel.
+class DiskReader
+{
+public:
+	// Called on the reader thread with the data, or with NULL and -errno
+	typedef std::function<void(const char *data, int length)> callback;
+
+	DiskReader();
+
+	~DiskReader();
+
+	// Set up the ring and start the thread. Fails if io_uring is not
+	// available.
+	bool start();
+
+	void stop();
+
+	bool running();
+
+	// Queue a read of length bytes at offset of fd. Fails once the ring
+	// has failed.
+	bool submit(int fd, off_t offset, int length, callback done);
+
+private:
+	struct request {
+		int fd;
+		off_t offset;
+		int length;
+		callback done;
+	};
+
+	static void *loop(void *data);
+
+	void run();
+
+	// Fail reads that won't complete, after the ring failed
+	void abort(std::vector<callback>& inflight);
+
+	bool started = false;
+
+	bool quit = false;
+
+	// Whether the thread gave up on the ring
+	bool failed = false;
+
+	pthread_t thread;
+
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+	// Reads not yet submitted
+	std::deque<request> queue;
+
+	// Written to wake up the thread
+	int event_fd = -1;
+
+	std::vector<char> buffers;
+
+	// Whether the kernel accepted the buffers as fixed buffers
+	bool registered = false;
+
+#ifdef HAVE_LIBURING_H
+	struct io_uring ring;
+#endif
+};
+
+}
+
+#endif
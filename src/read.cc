@@ -0,0 +1,298 @@
+/*
+Copyright 2015 Johan Gunnarsson <johan.gunnarsson@gmail.com>
+
+This file is part of BTFS.
+
+BTFS is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+BTFS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#include "read.h"
+
+// Least milliseconds between fetches from mirrors by the same read
+#define MIRROR_RETRY_DELAY 1000
+
+namespace btfs
+{
+
+struct timespec
+deadline_after(int ms) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000L;
+
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec += 1;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	return ts;
+}
+
+bool
+is_before(const struct timespec& a, const struct timespec& b) {
+	return a.tv_sec < b.tv_sec ||
+		(a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+int ReadSource::read(char *buf, int index, off_t offset, size_t size,
+		Window& window, bool nonblock) {
+	Read *r = new Read(this, buf, index, offset, size);
+
+	reads.push_back(r);
+
+	// Wait for read to finish
+	int s = r->read(window, nonblock);
+
+	reads.remove(r);
+
+	delete r;
+
+	return s;
+}
+
+void ReadSource::piece_finished(int piece) {
+	for (reads_iter i = reads.begin(); i != reads.end(); ++i) {
+		(*i)->trigger();
+	}
+}
+
+void ReadSource::piece_read(int piece, const char *buf, int size,
+		bool failed) {
+	for (reads_iter i = reads.begin(); i != reads.end(); ++i) {
+		if (failed)
+			(*i)->fail(piece);
+		else
+			(*i)->copy(piece, buf, size);
+	}
+}
+
+Read::Read(ReadSource *source, char *buf, int index, off_t offset,
+		size_t size) : source(source), index(index) {
+	int64_t file_size = source->file_size(index);
+
+	while (size > 0 && offset < file_size) {
+		int piece, start;
+
+		source->map_file(index, offset, piece, start);
+
+		int length = (int) std::min(std::min((int64_t) size,
+			file_size - offset),
+			(int64_t) (source->piece_size(piece) - start));
+
+		parts.push_back(Part(piece, start, length, buf, offset));
+
+		size -= (size_t) length;
+		offset += length;
+		buf += length;
+	}
+}
+
+void Read::fail(int piece) {
+	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
+		if (i->piece == piece && !i->filled)
+			failed = true;
+	}
+}
+
+void Read::copy(int piece, const char *buffer, int size) {
+	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
+		if (i->piece == piece && !i->filled) {
+			i->filled = (memcpy(i->buf, buffer + i->start,
+				(size_t) i->length)) != NULL;
+
+			source->event(TRACE_DELIVERED, piece, i->length);
+		}
+	}
+}
+
+void Read::trigger() {
+	for (size_t n = 0; n < parts.size(); n++) {
+		Part& p = parts[n];
+
+		if (p.filled || p.direct || !source->have_piece(p.piece))
+			continue;
+
+		if (!p.no_direct && source->read_direct(this, n, index, p.offset,
+				p.length)) {
+			p.direct = true;
+			pending++;
+		} else {
+			source->read_piece(p.piece);
+		}
+	}
+}
+
+void Read::direct_done(size_t part, const char *data, int length) {
+	Part& p = parts[part];
+
+	pending--;
+
+	p.direct = false;
+
+	if (!data) {
+		// Go through libtorrent instead
+		p.no_direct = true;
+
+		if (!p.filled)
+			source->read_piece(p.piece);
+	} else if (!p.filled) {
+		p.filled = (memcpy(p.buf, data, (size_t) length)) != NULL;
+
+		source->event(TRACE_DELIVERED, p.piece, length);
+	}
+}
+
+bool Read::finished() {
+	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
+		if (!i->filled)
+			return false;
+	}
+
+	return true;
+}
+
+int Read::size() {
+	int s = 0;
+
+	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
+		s += i->length;
+	}
+
+	return s;
+}
+
+void Read::fetch() {
+	std::vector<int> pieces;
+
+	// Parts are in piece order, a piece may hold several
+	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
+		if (!i->filled && !source->have_piece(i->piece) &&
+				(pieces.empty() || pieces.back() != i->piece))
+			pieces.push_back(i->piece);
+	}
+
+	if (pieces.empty())
+		return;
+
+	// Don't hold the lock during the transfers
+	pthread_mutex_unlock(source->lock);
+
+	source->fetch(pieces);
+
+	pthread_mutex_lock(source->lock);
+}
+
+bool Read::ready() {
+	for (parts_iter i = parts.begin(); i != parts.end(); ++i) {
+		// Ready unless more contiguous data is on its way from disk
+		if (!i->filled)
+			return i != parts.begin() &&
+				!source->have_piece(i->piece);
+	}
+
+	return true;
+}
+
+int Read::prefix() {
+	int s = 0;
+
+	for (parts_iter i = parts.begin(); i != parts.end() && i->filled; ++i) {
+		s += i->length;
+	}
+
+	return s;
+}
+
+void Read::settle() {
+	while (pending > 0)
+		pthread_cond_wait(source->cond, source->lock);
+}
+
+int Read::read(Window& window, bool nonblock) {
+	if (size() <= 0)
+		return 0;
+
+	// Trigger reads of finished pieces
+	trigger();
+
+	// Move sliding window to first piece to serve this request
+	window.jump(parts.front().piece, size());
+
+	struct timespec seed_deadline = deadline_after(source->mirror_delay);
+	struct timespec wait_deadline = deadline_after(source->max_read_wait);
+
+	// Whether the read has been blocked longer than allowed
+	bool expired = false;
+
+	while (!finished() && !failed) {
+		// Return the downloaded beginning instead of waiting for the rest
+		if (source->short_reads && ready())
+			break;
+
+		if (expired && prefix() > 0)
+			break;
+
+		struct timespec *deadline = NULL;
+
+		if (source->has_mirrors())
+			deadline = &seed_deadline;
+
+		if (source->max_read_wait > 0 && !expired &&
+				(!deadline || is_before(wait_deadline, *deadline)))
+			deadline = &wait_deadline;
+
+		if (!deadline) {
+			// Wait for any piece to downloaded
+			pthread_cond_wait(source->cond, source->lock);
+			continue;
+		}
+
+		if (pthread_cond_timedwait(source->cond, source->lock,
+				deadline) != ETIMEDOUT)
+			continue;
+
+		if (deadline == &seed_deadline) {
+			// Blocked for too long, get missing pieces from a mirror
+			fetch();
+
+			// Don't hammer a mirror that failed
+			seed_deadline = deadline_after(std::max(source->mirror_delay,
+				MIRROR_RETRY_DELAY));
+		} else {
+			expired = true;
+
+			// Nothing to return yet, let a non-blocking reader retry
+			if (nonblock && prefix() == 0) {
+				settle();
+				return -EAGAIN;
+			}
+		}
+	}
+
+	settle();
+
+	if (failed)
+		return -EIO;
+	else
+		return prefix();
+}
+
+}
@@ -0,0 +1,194 @@
+/*
+Copyright 2015 Johan Gunnarsson <johan.gunnarsson@gmail.com>
+
+This file is part of BTFS.
+
+BTFS is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+BTFS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BTFS_READ_H
+#define BTFS_READ_H
+
+#include <vector>
+#include <list>
+#include <cstdint>
+
+#include <sys/types.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "btfstrace.h"
+#include "window.h"
+
+namespace btfs
+{
+
+class Part;
+class Read;
+
+typedef std::vector<Part>::iterator parts_iter;
+typedef std::list<Read*>::iterator reads_iter;
+
+// The data of a torrent, as seen by readers. Implemented on top of
+// libtorrent by btfs and on top of a fake torrent by btfsbench. All
+// methods are called with lock held, unless noted otherwise.
+class ReadSource : public PieceSource
+{
+public:
+	ReadSource(pthread_mutex_t *l, pthread_cond_t *c) : lock(l), cond(c) {
+	}
+
+	virtual int piece_size(int piece) = 0;
+
+	virtual int64_t file_size(int index) = 0;
+
+	// Piece holding offset of file index, and the offset within it
+	virtual void map_file(int index, int64_t offset, int& piece,
+		int& start) = 0;
+
+	// Read a finished piece, handed back later through piece_read()
+	virtual void read_piece(int piece) = 0;
+
+	// Read a part of a finished piece straight from disk, handed back
+	// later through r->direct_done(). Returns false if not possible.
+	virtual bool read_direct(Read *r, size_t part, int index, off_t offset,
+			int length) {
+		return false;
+	}
+
+	// Whether data can be fetched from somewhere other than the swarm
+	virtual bool has_mirrors() {
+		return false;
+	}
+
+	// Fetch pieces from a mirror, which finish through piece_finished()
+	// once verified. Called without lock held.
+	virtual void fetch(const std::vector<int>& pieces) {
+	}
+
+	virtual void event(trace_type type, int piece, int64_t value = 0) {
+	}
+
+	// Read size bytes at offset of file index, waiting for them to be
+	// downloaded. Returns the number of bytes read or -errno.
+	int read(char *buf, int index, off_t offset, size_t size,
+		Window& window, bool nonblock);
+
+	// Have reads waiting for piece ask for its data
+	void piece_finished(int piece);
+
+	// Hand the data of piece, or a failure to read it, to waiting reads
+	void piece_read(int piece, const char *buf, int size, bool failed);
+
+	// Guards reads, and is signalled whenever they may have progressed
+	pthread_mutex_t *lock;
+
+	pthread_cond_t *cond;
+
+	std::list<Read*> reads;
+
+	// Return the downloaded beginning of a read without waiting for the
+	// rest
+	bool short_reads = false;
+
+	// Milliseconds a read blocks before returning what it has, 0 for no
+	// limit
+	int max_read_wait = 0;
+
+	// Milliseconds to wait for the swarm before going to a mirror
+	int mirror_delay = 0;
+};
+
+class Part
+{
+	friend class Read;
+
+public:
+	Part(int p, int s, int l, char *b, off_t o) : piece(p), start(s),
+			length(l), buf(b), offset(o), filled(false), direct(false),
+			no_direct(false) {
+	}
+
+private:
+	int piece;
+
+	// Offset of this part within the piece
+	int start;
+
+	int length;
+
+	char *buf;
+
+	// Offset of this part within the file
+	off_t offset;
+
+	bool filled;
+
+	// Whether a direct read is in flight, or failed before
+	bool direct;
+
+	bool no_direct;
+};
+
+class Read
+{
+public:
+	Read(ReadSource *source, char *buf, int index, off_t offset,
+		size_t size);
+
+	void fail(int piece);
+
+	void copy(int piece, const char *buffer, int size);
+
+	void trigger();
+
+	// Complete a direct read of part, data is NULL if it failed
+	void direct_done(size_t part, const char *data, int length);
+
+	bool finished();
+
+	int size();
+
+	int read(Window& window, bool nonblock);
+
+private:
+	void fetch();
+
+	bool ready();
+
+	int prefix();
+
+	// Wait for direct reads in flight, which write into the buffer
+	void settle();
+
+	ReadSource *source;
+
+	bool failed = false;
+
+	// Number of direct reads in flight
+	int pending = 0;
+
+	int index;
+
+	std::vector<Part> parts;
+};
+
+// Absolute CLOCK_REALTIME time ms milliseconds from now
+struct timespec deadline_after(int ms);
+
+bool is_before(const struct timespec& a, const struct timespec& b);
+
+}
+
+#endif
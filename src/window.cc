@@ -0,0 +1,81 @@
+/*
+Copyright 2015 Johan Gunnarsson <johan.gunnarsson@gmail.com>
+
+This file is part of BTFS.
+
+BTFS is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+BTFS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+
+#include "window.h"
+
+using namespace btfs;
+
+bool Window::move_to_next_unfinished(int& piece) {
+	for (; piece < source->num_pieces(); piece++) {
+		if (!source->have_piece(piece))
+			return true;
+	}
+
+	return false;
+}
+
+void Window::release(int first, int end) {
+	for (auto i = held.begin(); i != held.end();) {
+		if (*i < first || *i >= end) {
+			source->left_window(*i, priority);
+
+			i = held.erase(i);
+		} else {
+			++i;
+		}
+	}
+}
+
+void Window::jump(int piece, int size) {
+	int tail = piece;
+
+	// Nothing left to download from piece on, the window is empty
+	if (!move_to_next_unfinished(tail)) {
+		release(tail, tail);
+		return;
+	}
+
+	cursor = tail;
+
+	int end = std::min(tail + pieces, source->num_pieces());
+
+	release(tail, end);
+
+	for (; tail < end; tail++) {
+		// Only pieces entering the window need a look at their priority
+		if (!held.insert(tail).second)
+			continue;
+
+		// Never lower the priority given by another window
+		if (source->piece_priority(tail) >= priority)
+			continue;
+
+		source->entered_window(tail);
+		source->piece_priority(tail, priority);
+
+		if (deadline > 0)
+			source->piece_deadline(tail, deadline);
+	}
+}
+
+void Window::advance() {
+	jump(cursor, 0);
+}
@@ -0,0 +1,108 @@
+/*
+Copyright 2015 Johan Gunnarsson <johan.gunnarsson@gmail.com>
+
+This file is part of BTFS.
+
+BTFS is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+BTFS is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with BTFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BTFS_WINDOW_H
+#define BTFS_WINDOW_H
+
+#include <set>
+
+// Priority of pieces in the sliding window
+#define WINDOW_PRIORITY 7
+
+// Default number of pieces in the sliding window
+#define WINDOW_SIZE 16
+
+// Priority and default size of the window of background readers
+#define BACKGROUND_PRIORITY 5
+#define BACKGROUND_WINDOW_SIZE 4
+
+namespace btfs
+{
+
+// The pieces of a torrent, as seen by the scheduling policy. Implemented
+// on top of libtorrent by btfs and on top of a model swarm by btfssim.
+class PieceSource
+{
+public:
+	virtual ~PieceSource() {
+	}
+
+	virtual int num_pieces() = 0;
+
+	virtual bool have_piece(int piece) = 0;
+
+	virtual int piece_priority(int piece) = 0;
+
+	virtual void piece_priority(int piece, int priority) = 0;
+
+	// Ask for piece to be downloaded within ms milliseconds
+	virtual void piece_deadline(int piece, int ms) {
+	}
+
+	// Called when a piece enters the sliding window
+	virtual void entered_window(int piece) {
+	}
+
+	// Called when a window of the given priority moves past a piece
+	virtual void left_window(int piece, int priority) {
+	}
+};
+
+// Sliding window of high priority pieces ahead of the readers
+class Window
+{
+public:
+	Window(PieceSource *s, int n = WINDOW_SIZE, int p = WINDOW_PRIORITY,
+			int d = 0) : source(s), pieces(n), priority(p),
+			deadline(d), cursor(0) {
+	}
+
+	// Move sliding window to first unfinished piece from piece
+	void jump(int piece, int size);
+
+	// Move sliding window past newly finished pieces
+	void advance();
+
+private:
+	bool move_to_next_unfinished(int& piece);
+
+	// Forget the held pieces outside of [first, end)
+	void release(int first, int end);
+
+	PieceSource *source;
+
+	// Number of pieces in the window
+	int pieces;
+
+	// Priority given to pieces in the window
+	int priority;
+
+	// Deadline in ms of pieces entering the window, 0 for none
+	int deadline;
+
+	// First piece index of the current sliding window
+	int cursor;
+
+	// Pieces in the window that have been given its priority
+	std::set<int> held;
+};
+
+}
+
+#endif